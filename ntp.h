@@ -0,0 +1,167 @@
+/* ntp.h - NTP packet codec and the shared clock correction page */
+#ifndef NTP_H
+#define NTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#define VERSION_3           3
+#define VERSION_4           4
+
+#define MODE_CLIENT         3
+#define MODE_SERVER         4
+
+#define NTP_HLEN            48
+
+#define JAN_1970            0x83aa7e80
+
+#define NTP_SHM_MAGIC       0x4e545043  /* "NTPC" */
+#define NTP_SHM_PATH        "/dev/shm/ntpc"
+
+/* all fields in network byte order */
+struct s_fixedpt {
+    uint16_t    intpart;
+    uint16_t    fracpart;
+};
+
+struct l_fixedpt {
+    uint32_t    intpart;
+    uint32_t    fracpart;
+};
+
+struct ntphdr {
+    uint8_t             ntp_lvm;        /* leap indicator:2 version:3 mode:3 */
+    uint8_t             ntp_stratum;
+    uint8_t             ntp_poll;
+    int8_t              ntp_precision;
+    struct s_fixedpt    ntp_rtdelay;
+    struct s_fixedpt    ntp_rtdispersion;
+    uint32_t            ntp_refid;
+    struct l_fixedpt    ntp_refts;
+    struct l_fixedpt    ntp_orits;
+    struct l_fixedpt    ntp_recvts;
+    struct l_fixedpt    ntp_transts;
+};
+
+/*
+ * Everything below is static inline and free of side effects, so calls
+ * with constant arguments (a fixed version and mode when building a
+ * packet) fold into straight-line stores at the call site.
+ */
+
+/* a header view of buf, or NULL if len is too short to hold one */
+static inline struct ntphdr *ntp_view(void *buf, size_t len)
+{
+    return len < NTP_HLEN ? NULL : (struct ntphdr *) buf;
+}
+
+static inline int ntp_li(const struct ntphdr *ntp)
+{
+    return ntp->ntp_lvm >> 6;
+}
+
+static inline int ntp_vn(const struct ntphdr *ntp)
+{
+    return ntp->ntp_lvm >> 3 & 7;
+}
+
+static inline int ntp_mode(const struct ntphdr *ntp)
+{
+    return ntp->ntp_lvm & 7;
+}
+
+static inline void ntp_set_lvm(struct ntphdr *ntp, int li, int vn, int mode)
+{
+    ntp->ntp_lvm = (uint8_t) ((li & 3) << 6 | (vn & 7) << 3 | (mode & 7));
+}
+
+/* 16.16 fixed point seconds (root delay and dispersion) */
+static inline double ntp_short_to_double(struct s_fixedpt s)
+{
+    return ntohs(s.intpart) + ntohs(s.fracpart) / 65536.0;
+}
+
+static inline struct s_fixedpt ntp_short_from_double(double d)
+{
+    struct s_fixedpt s;
+    uint32_t v;
+
+    v = d <= 0 ? 0 : d >= 65536 ? UINT32_MAX : (uint32_t) (d * 65536);
+    s.intpart = htons(v >> 16);
+    s.fracpart = htons(v & 0xffff);
+    return s;
+}
+
+/* 32.32 fixed point timestamps, converted from and to unix time */
+static inline int64_t ntp_ts_to_usec(struct l_fixedpt ts)
+{
+    return ((int64_t) ntohl(ts.intpart) - JAN_1970) * 1000000
+           + (int64_t) (((uint64_t) ntohl(ts.fracpart) * 1000000) >> 32);
+}
+
+static inline int64_t ntp_ts_to_nsec(struct l_fixedpt ts)
+{
+    return ((int64_t) ntohl(ts.intpart) - JAN_1970) * 1000000000
+           + (int64_t) (((uint64_t) ntohl(ts.fracpart) * 1000000000) >> 32);
+}
+
+static inline struct l_fixedpt ntp_ts_from_usec(int64_t usec)
+{
+    struct l_fixedpt ts;
+
+    ts.intpart = htonl((uint32_t) (usec / 1000000 + JAN_1970));
+    ts.fracpart = htonl((uint32_t) (((uint64_t) (usec % 1000000) << 32) / 1000000));
+    return ts;
+}
+
+static inline double ntp_ts_to_double(struct l_fixedpt ts)
+{
+    return (double) ((int64_t) ntohl(ts.intpart) - JAN_1970) + ntohl(ts.fracpart) / 4294967296.0;
+}
+
+/*
+ * The correction page ntpc publishes with "shm" for processes that cannot
+ * set the clock themselves (ntpshim.c).  A seqlock: the writer makes seq
+ * odd, stores, and makes it even again; readers retry while it is odd or
+ * changed under them, so neither side ever blocks.  An offset is only
+ * good until expires, so one left behind by a dead ntpc ages out.
+ */
+struct ntp_shm {
+    uint32_t            magic;
+    _Atomic uint32_t    seq;
+    _Atomic int64_t     offset;     /* ns to add to CLOCK_REALTIME */
+    _Atomic int64_t     updated;    /* unix ns of the sample it came from */
+    _Atomic int64_t     expires;    /* system clock ns the offset is stale from, 0 if none */
+};
+
+static inline void ntp_shm_store(struct ntp_shm *shm, int64_t offset, int64_t updated, int64_t expires)
+{
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&shm->offset, offset, memory_order_relaxed);
+    atomic_store_explicit(&shm->updated, updated, memory_order_relaxed);
+    atomic_store_explicit(&shm->expires, expires, memory_order_relaxed);
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+/* the offset in ns for the system clock reading now (ns), -1 if it is stale */
+static inline int ntp_shm_read(const struct ntp_shm *shm, int64_t now, int64_t *offset)
+{
+    uint32_t seq;
+    int64_t expires;
+
+    do
+    {
+        seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+        *offset = atomic_load_explicit(&shm->offset, memory_order_relaxed);
+        expires = atomic_load_explicit(&shm->expires, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&shm->seq, memory_order_relaxed));
+    return now < expires ? 0 : -1;
+}
+
+#endif
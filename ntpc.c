@@ -1,102 +1,239 @@
 /* ntpclient.c */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
-#include <endian.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/timex.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <linux/vm_sockets.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
-#define VERSION_3           3
-#define VERSION_4           4
-
-#define MODE_CLIENT         3
-#define MODE_SERVER         4
+#include "ntp.h"
+#include "ptp.h"
 
 #define NTP_LI              0
 #define NTP_VN              VERSION_3
 #define NTP_MODE            MODE_CLIENT
 #define NTP_STRATUM         0
 #define NTP_POLL            4
+#define POLL_MIN            -4          /* 1/16 s, trusted servers only */
+#define POLL_MAX            17
+#define POLL_GLOBAL         127         /* a server without its own poll uses the global one */
 #define NTP_PRECISION       -6
-
-#define NTP_HLEN            48
+#define NTP_LOCAL_STRATUM   10          /* served while not synchronised */
 
 #define NTP_PORT            123
 #define NTP_SERVER         "pool.ntp.org"
 
 #define TIMEOUT             10
 
-#define BUFSIZE             1500
+/*
+ * Capacity limits.  Every table is sized from these at compile time and
+ * nothing is allocated once ntpc runs (collect mode takes its tables once,
+ * as it starts), so a constrained build only needs smaller values, e.g.
+ * -DCONF_MAX_SERVERS=2 -DMRU_SIZE=64.
+ */
+#ifndef CONF_MAX_SERVERS
+#define CONF_MAX_SERVERS    8
+#endif
+#ifndef CONF_SIZE
+#define CONF_SIZE           8192        /* largest config file */
+#endif
+
+#define BURST_COUNT         1
+#ifndef BURST_MAX
+#define BURST_MAX           8
+#endif
+#define BURST_INTERVAL      2000        /* ms between burst packets */
+#define BURST_HISTORY       8           /* bursts whose best delay sets the floor */
+#define BURST_EPSILON       0.1         /* a reply this close to the floor ends the burst */
+#define BURST_EPSILON_ABS   0.00002     /* seconds, plus this much */
+#define BURST_SPREAD        1.0         /* delays spread wider than the floor extend it */
+
+#define TXTIME_LEAD         1000000     /* ns, hand a SO_TXTIME packet to the kernel this early */
+#define PACE_SLACK          200000      /* ns, finish the pacing wait with clock_nanosleep */
 
-#define JAN_1970            0x83aa7e80
+#define SMEAR_STEPS         64
+#define SLEW_MAX            0.128       /* s, a resident instance slews smaller offsets */
+#define REPORT_INTERVAL     1000000000  /* ns, resident rounds print at most this often */
+#define SHM_POLLS           4           /* a published offset expires after this many poll intervals */
 
-#define NTP_CONV_FRAC32(x)  (uint64_t) ((x) * ((uint64_t)1<<32))
-#define NTP_REVE_FRAC32(x)  ((double) ((double) (x) / ((uint64_t)1<<32)))
+#ifndef MRU_SIZE
+#define MRU_SIZE            1024        /* client table entries, a power of two */
+#endif
+#define MRU_WAYS            4
+#define CTL_BUFSIZE         (MRU_SIZE * 96 + 1024)
 
-#define NTP_CONV_FRAC16(x)  (uint32_t) ((x) * ((uint32_t)1<<16))
-#define NTP_REVE_FRAC16(x)  ((double)((double) (x) / ((uint32_t)1<<16)))
+#define RECORD_BATCH        64          /* sample records written per write() */
+#define RECORD_MAGIC        "NTPCREC2"
 
-#define USEC2FRAC(x)        ((uint32_t) NTP_CONV_FRAC32( (x) / 1000000.0 ))
-#define FRAC2USEC(x)        ((uint32_t) NTP_REVE_FRAC32( (x) * 1000000.0 ))
+#ifndef TELEMETRY_RING
+#define TELEMETRY_RING      256         /* records waiting for the collector */
+#endif
+#define TELEMETRY_BATCH     12          /* records per message, one 1500 byte datagram */
+#define TELEMETRY_MAGIC     "NTPCTEL2"
 
-#define NTP_LFIXED2DOUBLE(x)    ((double) ( ntohl(((struct l_fixedpt *) (x))->intpart) - JAN_1970 + FRAC2USEC(ntohl(((struct l_fixedpt *) (x))->fracpart)) / 1000000.0 ))
+#ifndef COLLECT_SIZE
+#define COLLECT_SIZE        16384       /* (host, server) entries, a power of two */
+#endif
+#define COLLECT_WINDOW      32          /* offsets kept per entry */
+#define COLLECT_PROBE       16
+#ifndef COLLECT_CONNS
+#define COLLECT_CONNS       4096        /* TCP senders at a time */
+#endif
+#define COLLECT_IDLE        300         /* s, a TCP sender silent this long is disconnected */
+#define COLLECT_OUTLIER     0.05        /* seconds */
 
+#define MESH_PROBE          1           /* mesh peers probed per poll interval */
 
-struct s_fixedpt {
-    uint16_t    intpart;
-    uint16_t    fracpart;
-};
+#ifndef STATE_SIZE
+#define STATE_SIZE          4096        /* target state entries, a power of two */
+#endif
+#define STATE_PROBE         16
+#define STATE_MAGIC         "NTPCSTA2"
+#define STATE_BACKOFF       6           /* a stable target is polled up to 2^6 times less often */
+#define STATE_STABLE        0.002       /* seconds, offset change still counted as stable */
 
-struct l_fixedpt {
-    uint32_t    intpart;
-    uint32_t    fracpart;
-};
+#ifndef VSOCK_CONNS
+#define VSOCK_CONNS         16          /* guests connected to the vsock server at once */
+#endif
 
-struct ntphdr {
-#if __BYTE_ORDER == __BID_ENDIAN
-    unsigned int    ntp_li:2;
-    unsigned int    ntp_vn:3;
-    unsigned int    ntp_mode:3;
+#ifndef EVENT_HOST
+#define EVENT_HOST          64          /* server name carried to the compute thread */
 #endif
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    unsigned int    ntp_mode:3;
-    unsigned int    ntp_vn:3;
-    unsigned int    ntp_li:2;
+#ifndef EVENT_RING
+#define EVENT_RING          256         /* samples queued for the compute thread, a power of two */
 #endif
-    uint8_t         ntp_stratum;
-    uint8_t         ntp_poll;
-    int8_t          ntp_precision;
-    struct s_fixedpt    ntp_rtdelay;
-    struct s_fixedpt    ntp_rtdispersion;
-    uint32_t            ntp_refid;
-    struct l_fixedpt    ntp_refts;
-    struct l_fixedpt    ntp_orits;
-    struct l_fixedpt    ntp_recvts;
-    struct l_fixedpt    ntp_transts;
+#define COMMAND_RING        16
+#define RELOAD_RETRY        1000000     /* ns, retry a reload the compute thread has not caught up with */
+
+#ifndef SERVE_BATCH
+#define SERVE_BATCH         32          /* requests read and answered per system call */
+#endif
+
+#define LEADER_MAGIC        "NTPCLDR2"
+#define LEADER_CHECK        1000000000  /* ns, how often a follower tries to take over */
+
+#define HANDOFF_MAGIC       "NTPCHND1"
+#define HANDOFF_VERSION     3
+
+#define REOPEN_INTERVAL     5000000000  /* ns between attempts at a server socket that failed to open */
+
+#define CONSENSUS_MIN       3           /* answers needed before falsetickers are named */
+#define CONSENSUS_MAD       3.0         /* falseticker beyond this many MAD sigmas */
+#define CONSENSUS_POLLS     4           /* a vote not renewed within this many poll intervals is dropped */
+#define MAD_SIGMA           1.4826      /* MAD to standard deviation, normal errors */
+#define MIN_DISPERSION      0.000001    /* seconds, floor of every root distance */
+
+#define PTP_SYNC_INTERVAL   -3          /* log2 s between the Syncs a master is asked for */
+#define PTP_GRANT           2           /* s the grant outlasts the burst */
+#define PTP_PRECISION       -20         /* software timestamps, about a microsecond */
+#define PTP_BIND_TRIES      8           /* attempts at an ephemeral event/general port pair */
+
+#define BUFSIZE             1500
+
+int64_t now_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Cold start phases for -t, CLOCK_MONOTONIC ns except exec, which is
+ * how long the process existed before main() (loading and linking).
+ */
+struct ntp_timing {
+    int64_t     exec;
+    int64_t     main;
+    int64_t     dns;            /* spent resolving, summed */
+    int64_t     sockets;        /* peers opened */
+    int64_t     start;          /* first request about to go out */
+    int64_t     first;          /* first usable reply */
+    int64_t     quorum;
+    int64_t     applied;
 };
 
+static struct ntp_timing timing;
+
+/* exec time from NTPC_T0 (unix ns, set by the caller) or, coarser, /proc */
+int64_t exec_ns(void)
+{
+    char buf[1024], *p;
+    unsigned long long start;
+    const char *t0;
+    int fd, i;
+    ssize_t n;
+
+    if ((t0 = getenv("NTPC_T0")) != NULL)
+        return now_ns(CLOCK_REALTIME) - strtoll(t0, NULL, 10);
+
+    if ((fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0 || (p = strrchr((buf[n] = 0, buf), ')')) == NULL)
+        return 0;
+    /* starttime is field 22, the 20th after the command name */
+    for (i = 0; i < 20 && p; i++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL || sscanf(p, "%llu", &start) != 1)
+        return 0;
+    return now_ns(CLOCK_BOOTTIME) - (int64_t) (start * (1000000000 / sysconf(_SC_CLK_TCK)));
+}
+
+void timing_report(void)
+{
+    int64_t first = timing.first ? timing.first : timing.quorum;
+
+    printf("timing exec %.3f dns %.3f socket %.3f first %.3f quorum %.3f apply %.3f total %.3f ms \n",
+           timing.exec / 1e6, timing.dns / 1e6, timing.sockets / 1e6, (first - timing.start) / 1e6,
+           (timing.quorum - first) / 1e6, (timing.applied - timing.quorum) / 1e6,
+           (timing.exec + timing.applied - timing.main) / 1e6);
+}
+
 in_addr_t inet_host(const char *host)
 {
     in_addr_t saddr;
     struct hostent *hostent;
+    int64_t t;
 
     if ((saddr = inet_addr(host)) == INADDR_NONE)
     {
-        if ((hostent = gethostbyname(host)) == NULL)
+        t = now_ns(CLOCK_MONOTONIC);
+        hostent = gethostbyname(host);
+        timing.dns += now_ns(CLOCK_MONOTONIC) - t;
+        if (hostent == NULL)
             return INADDR_NONE;
         memmove(&saddr, hostent->h_addr, hostent->h_length);
     }
     return saddr;
 }
 
-int get_ntp_packet(void *buf, size_t *size)
+int get_ntp_packet(void *buf, size_t *size, int version)
 {
     struct ntphdr *ntp;
     struct timeval tv;
@@ -107,73 +244,57 @@ int get_ntp_packet(void *buf, size_t *size)
     memset(buf, 0, *size);
 
     ntp = (struct ntphdr *) buf;
-    ntp->ntp_li = NTP_LI;
-    ntp->ntp_vn = NTP_VN;
-    ntp->ntp_mode = NTP_MODE;
+    ntp_set_lvm(ntp, NTP_LI, version, NTP_MODE);
     ntp->ntp_stratum = NTP_STRATUM;
     ntp->ntp_poll = NTP_POLL;
     ntp->ntp_precision = NTP_PRECISION;
 
     gettimeofday(&tv, NULL);
-    ntp->ntp_transts.intpart = htonl(tv.tv_sec + JAN_1970);
-    ntp->ntp_transts.fracpart = htonl(USEC2FRAC(tv.tv_usec));
+    ntp->ntp_transts = ntp_ts_from_usec((int64_t) tv.tv_sec * 1000000 + tv.tv_usec);
 
     *size = NTP_HLEN;
 
     return 0;
 }
 
-void print_ntp(struct ntphdr *ntp)
+void print_ts(const char *name, struct l_fixedpt ts)
 {
-    time_t time;
+    int64_t usec = ntp_ts_to_usec(ts);
+    time_t time = usec / 1000000;
+    char date[32];
 
-    printf("LI:\t%d \n", ntp->ntp_li);
-    printf("VN:\t%d \n", ntp->ntp_vn);
-    printf("Mode:\t%d \n", ntp->ntp_mode);
+    ctime_r(&time, date);
+    date[strcspn(date, "\n")] = '\0';
+    printf("%s:\t%ld %06ld frac=%u (%s) \n", name, (long) time, (long) (usec % 1000000),
+           ntohl(ts.fracpart), date);
+}
+
+void print_ntp(const struct ntphdr *ntp)
+{
+    printf("LI:\t%d \n", ntp_li(ntp));
+    printf("VN:\t%d \n", ntp_vn(ntp));
+    printf("Mode:\t%d \n", ntp_mode(ntp));
     printf("Stratum:\t%d \n", ntp->ntp_stratum);
-    printf("Poll:\t%d \n", ntp->ntp_poll);
+    printf("Poll:\t%d \n", (int8_t) ntp->ntp_poll);
     printf("precision:\t%d \n", ntp->ntp_precision);
 
-    printf("Route delay:\t %lf \n",
-           ntohs(ntp->ntp_rtdelay.intpart) + NTP_REVE_FRAC16(ntohs(ntp->ntp_rtdelay.fracpart)));
-    printf("Route Dispersion:\t%lf \n",
-           ntohs(ntp->ntp_rtdispersion.intpart) + NTP_REVE_FRAC16(ntohs(ntp->ntp_rtdispersion.fracpart)));
-    printf("Referencd ID:\t %d \n", ntohl(ntp->ntp_refid));
-
+    printf("Route delay:\t %lf \n", ntp_short_to_double(ntp->ntp_rtdelay));
+    printf("Route Dispersion:\t%lf \n", ntp_short_to_double(ntp->ntp_rtdispersion));
+    printf("Referencd ID:\t %u \n", ntohl(ntp->ntp_refid));
 
-    time = ntohl(ntp->ntp_refts.intpart) - JAN_1970;
-    printf("Reference:\t%d %ld %s \n",
-           ntohl(ntp->ntp_refts.intpart) - JAN_1970,
-           FRAC2USEC(ntohl(ntp->ntp_refts.fracpart)),
-           ctime(&time));
-
-    time = ntohl(ntp->ntp_orits.intpart) - JAN_1970;
-    printf("Originate:\t%d %d frac=%ld (%s) \n",
-           ntohl(ntp->ntp_orits.intpart) - JAN_1970,
-           FRAC2USEC(ntohl(ntp->ntp_orits.fracpart)),
-           ntohl(ntp->ntp_orits.fracpart),
-           ctime(&time) );
-
-    time = ntohl(ntp->ntp_recvts.intpart) - JAN_1970;
-    printf("Receive:\t%d %d (%s) \n",
-           ntohl(ntp->ntp_recvts.intpart) - JAN_1970,
-           FRAC2USEC(ntohl(ntp->ntp_recvts.fracpart)),
-           ctime(&time) );
-
-    time = ntohl(ntp->ntp_transts.intpart) - JAN_1970;
-    printf("Transmit:\t%d %d (%s) \n",
-           ntohl(ntp->ntp_transts.intpart) - JAN_1970,
-           FRAC2USEC(ntohl(ntp->ntp_transts.fracpart)),
-           ctime(&time) );
+    print_ts("Reference", ntp->ntp_refts);
+    print_ts("Originate", ntp->ntp_orits);
+    print_ts("Receive", ntp->ntp_recvts);
+    print_ts("Transmit", ntp->ntp_transts);
 }
 
 double get_rrt(const struct ntphdr *ntp, const struct timeval *recvtv)
 {
     double t1, t2, t3, t4;
 
-    t1 = NTP_LFIXED2DOUBLE(&ntp->ntp_orits);
-    t2 = NTP_LFIXED2DOUBLE(&ntp->ntp_recvts);
-    t3 = NTP_LFIXED2DOUBLE(&ntp->ntp_transts);
+    t1 = ntp_ts_to_double(ntp->ntp_orits);
+    t2 = ntp_ts_to_double(ntp->ntp_recvts);
+    t3 = ntp_ts_to_double(ntp->ntp_transts);
     t4 = recvtv->tv_sec + recvtv->tv_usec / 1000000.0;
 
     return (t4 - t1) - (t3 - t2);
@@ -183,94 +304,3984 @@ double get_offset(const struct ntphdr *ntp, const struct timeval *recvtv)
 {
     double t1, t2, t3, t4;
 
-    t1 = NTP_LFIXED2DOUBLE(&ntp->ntp_orits);
-    t2 = NTP_LFIXED2DOUBLE(&ntp->ntp_recvts);
-    t3 = NTP_LFIXED2DOUBLE(&ntp->ntp_transts);
+    t1 = ntp_ts_to_double(ntp->ntp_orits);
+    t2 = ntp_ts_to_double(ntp->ntp_recvts);
+    t3 = ntp_ts_to_double(ntp->ntp_transts);
     t4 = recvtv->tv_sec + recvtv->tv_usec / 1000000.0;
 
     return ((t2 - t1) + (t3 - t4)) / 2;
 }
 
-void usage(void)
+/* one validated reply */
+struct ntp_sample {
+    int64_t     t1, t2, t3, t4;     /* unix ns */
+    double      offset;
+    double      delay;
+    int         li;
+    int         version;
+    int         stratum;
+    int         poll;
+    int         precision;
+    uint32_t    refid;
+    double      rootdelay;
+    double      rootdisp;
+    uint32_t    kod;                /* kiss code of a stratum 0 reply, else 0 */
+    int         valid;              /* offset and delay hold a measurement */
+};
+
+/*
+ * Leap smear for served time: across window seconds centred on the
+ * leap the offset follows table[], the fraction of the leap second
+ * already absorbed at each of SMEAR_STEPS equal slices of the window.
+ */
+struct ntp_smear {
+    int64_t     leap;           /* unix time the kernel inserts the leap second, 0 disables */
+    int         window;
+    double      table[SMEAR_STEPS + 1];
+};
+
+/* what the server hands out about its own synchronisation */
+struct ntp_sync {
+    int         stratum;
+    uint32_t    refid;
+    int64_t     reftime;        /* usec */
+    double      delay;          /* root delay, seconds */
+    double      disp;           /* root dispersion, seconds */
+};
+
+struct ntp_server_conf {
+    char        host[NI_MAXHOST];
+    in_addr_t   addr;
+    int         port;
+    int         version;
+    int         burst;
+    int         interval;       /* ms */
+    int         txtime;
+    int         adaptive;       /* burst is where to start, it ends early or grows to BURST_MAX */
+    int         vsock;          /* addr is a vsock CID in network byte order */
+    int         ptp;            /* addr is a PTP master, port its event port */
+    int         mesh;           /* compared against, never used to set the clock */
+    int         trusted;        /* may be polled faster than once a second */
+    int         poll;           /* exponent, or POLL_GLOBAL */
+};
+
+/* a parsed configuration, never modified once it is published */
+struct ntp_conf {
+    struct ntp_server_conf  servers[CONF_MAX_SERVERS];
+    int         nservers;
+    int         poll;
+    int         timeout;
+    double      panic;          /* refuse to apply larger offsets, 0 disables */
+    char        record[NI_MAXHOST]; /* append sample records to this file */
+    char        state[NI_MAXHOST];  /* persistent target state, only due targets are queried */
+    char        shm[NI_MAXHOST];    /* publish the offset here instead of setting the clock */
+    char        leader[NI_MAXHOST]; /* elect one querying instance per host through this page */
+    char        collector[NI_MAXHOST];  /* ship sample records to this host */
+    int         collector_port;
+    int         collector_tcp;
+    int         collect;        /* receive telemetry on this port, 0 disables */
+    double      outlier;        /* flag hosts and servers further off than this */
+    int         quorum;         /* one-shot runs wait for this many answers, 0 for all */
+    int         meshprobe;
+    int         listen;         /* serve time on this port, 0 disables */
+    int         vsock;          /* and on this vsock port */
+    int         mru;            /* record 1 in mru requests in the client table, 0 disables */
+    char        control[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int         perf;           /* count the I/O thread's cycles per packet for the control socket */
+    char        handoff[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    struct ntp_smear    smear;
+    uint32_t    gen;            /* counts the reloads */
+};
+
+/* a burst in flight, driven by query_send() and query_recv() */
+struct ntp_query {
+    int                 active;
+    int                 sent;
+    int                 received;
+    int                 limit;      /* requests this burst, the configured burst unless adaptive */
+    double              dmin, dmax; /* delay range of the replies so far */
+    int64_t             next;       /* CLOCK_MONOTONIC ns of the next request */
+    int64_t             deadline;
+    struct l_fixedpt    xmt[BURST_MAX];
+    int64_t             txstamp[BURST_MAX]; /* when the kernel sent each, unix ns, 0 if unknown */
+    struct ntp_sample   best;
+    /* PTP: Delay_Req sent and received times, unix ns, -1 once used */
+    uint16_t            seq0;       /* sequenceId of the first Delay_Req */
+    int64_t             dreq[BURST_MAX];
+    int64_t             dresp[BURST_MAX];
+    /* and the last Sync, origin time 0 until its Follow_Up */
+    uint16_t            syncseq;
+    int64_t             syncrx, synctx, synccorr;
+};
+
+struct ntp_peer {
+    const struct ntp_server_conf *conf;
+    struct sockaddr_in  addr;
+    int                 sockfd;
+    int                 txtime;
+    int                 stream; /* vsock: replies are framed at NTP_HLEN */
+    int                 connecting;     /* vsock connect in progress, see peer_connected() */
+    int                 ptp;    /* sockfd takes event messages, gsockfd general ones */
+    int                 gsockfd;
+    uint16_t            ptpseq;
+    int                 valid;  /* sample is fresh and not applied yet */
+    int                 falseticker;
+    struct ntp_state    *state; /* entry in the state file, or NULL */
+    struct ntp_sample   sample;
+    struct ntp_query    query;
+    int64_t             next;   /* CLOCK_MONOTONIC ns of the next poll */
+    int64_t             period; /* ns between polls */
+    double              delays[BURST_HISTORY];  /* best delay of the recent bursts */
+    unsigned int        ndelays;
+};
+
+/*
+ * Only an ETF qdisc holds a SO_TXTIME packet until its release time; any
+ * other sends it at once, TXTIME_LEAD early, or drops it (fq, whose
+ * horizon CLOCK_TAI times are far beyond).  So every paced request is
+ * also stamped by the kernel as it goes out, the stamp replaces its T1
+ * (txtime_check()), and a request sent well before its release time, a
+ * drop reported by ETF or a burst without a single stamp turns txtime
+ * off for the peer.
+ */
+int enable_txtime(int sockfd)
+{
+    struct sock_txtime cfg;
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    cfg.clockid = CLOCK_TAI;
+    cfg.flags = SOF_TXTIME_REPORT_ERRORS;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) != 0)
+        return -1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+void txtime_off(struct ntp_peer *peer, const char *why)
 {
-    fprintf(stderr, "Usage:\nntpc pool.ntp.org \nntpc ntp.aliyun.com\n");
+    fprintf(stderr, "SO_TXTIME not honoured for %s (%s), pacing with clock_nanosleep \n",
+            peer->conf->host, why);
+    peer->txtime = 0;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Receive one packet with the time the kernel took it off the wire (unix
+ * ns, SO_TIMESTAMPNS), so the stamp does not depend on how soon the
+ * caller got around to reading.  Sockets without it are stamped here.
+ */
+ssize_t recv_stamped(int fd, void *buf, size_t len, int flags, struct sockaddr_in *from,
+                     socklen_t *fromlen, int64_t *stamp)
+{
+    union {
+        char            buf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr  align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = from;
+    msg.msg_namelen = fromlen ? *fromlen : 0;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if ((n = recvmsg(fd, &msg, flags)) < 0)
+        return -1;
+    if (fromlen)
+        *fromlen = msg.msg_namelen;
+
+    *stamp = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *stamp = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    if (*stamp == 0)
+        *stamp = now_ns(CLOCK_REALTIME);
+    return n;
+}
+
+int enable_rx_timestamps(int fd)
+{
+    int on = 1;
+
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+/* txtime is the CLOCK_TAI release time in ns, 0 sends immediately */
+int send_ntp_packet(int sockfd, void *buf, size_t nbytes, uint64_t txtime)
+{
+    struct ntphdr *ntp = (struct ntphdr *) buf;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(uint64_t))];
+    int64_t realtime;
+
+    if (txtime == 0)
+        return send(sockfd, buf, nbytes, 0);
+
+    /* the packet leaves at txtime, so that is what T1 has to say */
+    realtime = now_ns(CLOCK_REALTIME) + ((int64_t) txtime - now_ns(CLOCK_TAI));
+    ntp->ntp_transts = ntp_ts_from_usec(realtime / 1000);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+
+    return sendmsg(sockfd, &msg, 0);
+}
+
+/*
+ * Take the transmit stamps of a txtime peer's requests off its error
+ * queue, which also keeps poll() from reporting POLLERR, and check that
+ * the requests really waited for their release time.
+ */
+void txtime_check(struct ntp_peer *peer)
 {
+    struct ntp_query *q = &peer->query;
+    union {
+        char            buf[CMSG_SPACE(sizeof(struct scm_timestamping))
+                            + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct cmsghdr  align;
+    } control;
     char buf[BUFSIZE];
-    size_t nbytes;
-    int sockfd, maxfd1;
-    struct sockaddr_in servaddr;
-    fd_set readfds;
-    struct timeval timeout, recvtv, tv;
-    double offset;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping ts;
+    struct sock_extended_err err;
+    const char *why = NULL;
+    int64_t stamp;
+    ssize_t n;
+    int i;
 
-    if (argc != 2) {
-        usage();
-        exit(-1);
+    for (;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if ((n = recvmsg(peer->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) < 0)
+            break;
+
+        stamp = 0;
+        err.ee_origin = 0;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                stamp = (int64_t) ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+            }
+            else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+        if (err.ee_origin == SO_EE_ORIGIN_TXTIME)
+            why = "dropped by the qdisc";
+        if (stamp == 0 || n < NTP_HLEN)
+            continue;
+
+        /* the request ends the looped back packet, whatever headers come first */
+        for (i = 0; i < q->sent; i++)
+            if (memcmp(buf + n - NTP_HLEN + offsetof(struct ntphdr, ntp_transts), &q->xmt[i],
+                       sizeof(struct l_fixedpt)) == 0)
+                break;
+        if (i == q->sent)
+            continue;
+        q->txstamp[i] = stamp;
+        if (stamp < ntp_ts_to_nsec(q->xmt[i]) - TXTIME_LEAD / 2)
+            why = "sent ahead of its release time";
     }
 
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(NTP_PORT);
-    servaddr.sin_addr.s_addr = inet_host(argv[1]);
-    //servaddr.sin_addr.s_addr = inet_host("119.28.183.184");
+    if (why && peer->txtime)
+        txtime_off(peer, why);
+}
+
+/*
+ * Read one reply to q: 0 if it is a valid answer to one of its requests,
+ * 2 for an answer without usable time (the header is kept, offset and
+ * delay are 0 and valid is not set), 1 for anything else and -1 when
+ * nothing is queued.
+ */
+int recv_ntp_sample(int sockfd, int stream, struct ntp_query *q, struct ntp_sample *sample)
+{
+    char buf[BUFSIZE];
+    struct ntphdr *ntp;
+    struct timeval recvtv;
+    ssize_t nbytes;
+    int64_t stamp, txstamp;
+    double d;
+    int i;
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    /* a stream carries headers back to back, take one only once it is whole */
+    if (stream)
     {
-        perror("socket error");
-        exit(-1);
+        if ((nbytes = recv(sockfd, buf, NTP_HLEN, MSG_PEEK)) == 0 || (nbytes < 0 && errno != EAGAIN))
+            return -2;
+        if (nbytes < NTP_HLEN)
+            return -1;
     }
+    if ((nbytes = recv_stamped(sockfd, buf, stream ? NTP_HLEN : BUFSIZE, 0, NULL, NULL, &stamp)) < 0)
+        return -1;
+    recvtv.tv_sec = stamp / 1000000000;
+    recvtv.tv_usec = stamp % 1000000000 / 1000;
+
+    if ((ntp = ntp_view(buf, nbytes)) == NULL || ntp_mode(ntp) != MODE_SERVER)
+        return 1;
+
+    for (i = 0; i < q->sent; i++)
+        if (memcmp(&ntp->ntp_orits, &q->xmt[i], sizeof(struct l_fixedpt)) == 0)
+            break;
+    if (i == q->sent || ntp->ntp_orits.intpart == 0)
+        return 1;
 
-    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(struct sockaddr)) != 0)
+    /* one answer per request, a duplicate or replay finds the slot cleared */
+    txstamp = q->txstamp[i];
+    memset(&q->xmt[i], 0, sizeof(q->xmt[i]));
+    q->txstamp[i] = 0;
+
+    sample->t1 = ntp_ts_to_nsec(ntp->ntp_orits);
+    sample->t2 = ntp_ts_to_nsec(ntp->ntp_recvts);
+    sample->t3 = ntp_ts_to_nsec(ntp->ntp_transts);
+    sample->t4 = stamp;
+    sample->li = ntp_li(ntp);
+    sample->version = ntp_vn(ntp);
+    sample->stratum = ntp->ntp_stratum;
+    sample->poll = (int8_t) ntp->ntp_poll;
+    sample->precision = ntp->ntp_precision;
+    sample->refid = ntp->ntp_refid;
+    sample->rootdelay = ntp_short_to_double(ntp->ntp_rtdelay);
+    sample->rootdisp = ntp_short_to_double(ntp->ntp_rtdispersion);
+    sample->kod = ntp->ntp_stratum == 0 ? ntp->ntp_refid : 0;
+
+    /* unsynchronised servers and kiss-o'-death packets carry no time */
+    if (ntp_li(ntp) == 3 || ntp->ntp_stratum == 0 || ntp->ntp_stratum > 15 || ntp->ntp_transts.intpart == 0)
     {
-        perror("connect error");
-        exit(-1);
+        sample->offset = 0;
+        sample->delay = 0;
+        sample->valid = 0;
+        return 2;
+    }
+
+    sample->offset = get_offset(ntp, &recvtv);
+    sample->delay = get_rrt(ntp, &recvtv);
+    sample->valid = 1;
+
+    /* T1 as the kernel sent the request rather than as it was scheduled */
+    if (txstamp)
+    {
+        d = (txstamp - sample->t1) / 1e9;
+        sample->t1 = txstamp;
+        sample->offset -= d / 2;
+        sample->delay -= d;
+    }
+
+    return 0;
+}
+
+/*
+ * PTP unicast client.  A burst is a run of Delay_Reqs; the first also asks
+ * the master (unicast negotiation) for Syncs and Delay_Resps for as long as
+ * the burst can last.  Each Delay_Resp paired with the latest two-step
+ * Sync makes one sample, its times laid out as an NTP exchange: t1/t2 the
+ * Delay_Req leaving and arriving, t3/t4 the Sync, so the offset and delay
+ * come out of the same arithmetic and feed the same filter.
+ */
+const struct ptp_port_id *ptp_id(void)
+{
+    static struct ptp_port_id id;
+    uint32_t pid;
+
+    if (id.port == 0)
+    {
+        pid = htonl((uint32_t) getpid());
+        memcpy(id.clock, "NTPC", 4);
+        memcpy(id.clock + 4, &pid, 4);
+        id.port = htons(1);
     }
+    return &id;
+}
 
-    nbytes = BUFSIZE;
-    if (get_ntp_packet(buf, &nbytes) != 0)
+int ptp_send(struct ntp_peer *peer)
+{
+    struct ntp_query *q = &peer->query;
+    char buf[sizeof(struct ptp_signaling) + 2 * PTP_TLV_REQUEST_LEN];
+    struct ptp_signaling *sig = (struct ptp_signaling *) buf;
+    struct ptp_msg req;
+    uint32_t duration;
+
+    if (q->sent == 0)
     {
-        fprintf(stderr, "construct ntp request error \n");
-        exit(-1);
+        duration = (peer->conf->adaptive ? BURST_MAX : q->limit) * peer->conf->interval / 1000 + PTP_GRANT;
+        ptp_init(&sig->hdr, PTP_SIGNALING, sizeof(buf), 0, ptp_id(), peer->ptpseq++, 0x7f);
+        memset(&sig->target, 0xff, sizeof(sig->target));
+        ptp_tlv_put(buf + sizeof(*sig), PTP_TLV_REQUEST_UNICAST, PTP_SYNC, PTP_SYNC_INTERVAL, duration);
+        ptp_tlv_put(buf + sizeof(*sig) + PTP_TLV_REQUEST_LEN, PTP_TLV_REQUEST_UNICAST, PTP_DELAY_RESP,
+                    PTP_SYNC_INTERVAL, duration);
+        if (send(peer->gsockfd, buf, sizeof(buf), 0) < 0)
+            return -1;
+
+        q->seq0 = peer->ptpseq;
+        q->syncrx = q->synctx = 0;
+        memset(q->dresp, 0, sizeof(q->dresp));
     }
-    send(sockfd, buf, nbytes, 0);
 
-    FD_ZERO(&readfds);
-    FD_SET(sockfd, &readfds);
-    maxfd1 = sockfd + 1;
+    ptp_init(&req.hdr, PTP_DELAY_REQ, sizeof(req), 0, ptp_id(), peer->ptpseq++, 0x7f);
+    q->dreq[q->sent] = now_ns(CLOCK_REALTIME);
+    req.ts = ptp_ts_from_nsec(q->dreq[q->sent]);
+    return send(peer->sockfd, &req, sizeof(req), 0);
+}
+
+/* a sample from the next unused Delay_Resp and a complete Sync, 0 if there is none */
+int ptp_pair(struct ntp_query *q, struct ntp_sample *sample)
+{
+    int i;
+
+    if (q->synctx == 0)
+        return 0;
+    for (i = 0; i < q->sent && q->dresp[i] <= 0; i++)
+        ;
+    if (i == q->sent)
+        return 0;
+
+    memset(sample, 0, sizeof(*sample));
+    sample->t1 = q->dreq[i];
+    sample->t2 = q->dresp[i];
+    sample->t3 = q->synctx;
+    sample->t4 = q->syncrx;
+    sample->offset = ((sample->t2 - sample->t1) + (sample->t3 - sample->t4)) / 2e9;
+    sample->delay = ((sample->t4 - sample->t1) - (sample->t3 - sample->t2)) / 1e9;
+    sample->version = PTP_VERSION;
+    sample->stratum = 1;
+    sample->poll = PTP_SYNC_INTERVAL;
+    sample->precision = PTP_PRECISION;
+    memcpy(&sample->refid, "PTP", 4);
+    sample->valid = 1;
+    q->dresp[i] = -1;
+    return 1;
+}
+
+void ptp_message(struct ntp_query *q, char *buf, ssize_t n, int64_t stamp)
+{
+    struct ptphdr *ptp;
+    struct ptp_msg *msg = (struct ptp_msg *) buf;
+    struct ptp_delay_resp *resp = (struct ptp_delay_resp *) buf;
+    uint16_t i;
+
+    if ((ptp = ptp_view(buf, n)) == NULL)
+        return;
+
+    switch (ptp_type(ptp)) {
+    case PTP_SYNC:
+        if (n < (ssize_t) sizeof(*msg))
+            break;
+        q->syncseq = ntohs(ptp->ptp_seq);
+        q->syncrx = stamp;
+        q->synccorr = ptp_correction(ptp);
+        q->synctx = ptp->ptp_flags[0] & PTP_FLAG_TWO_STEP ? 0 : ptp_ts_to_nsec(msg->ts) + q->synccorr;
+        break;
+    case PTP_FOLLOW_UP:
+        if (n >= (ssize_t) sizeof(*msg) && q->syncrx && !q->synctx && ntohs(ptp->ptp_seq) == q->syncseq)
+            q->synctx = ptp_ts_to_nsec(msg->ts) + q->synccorr + ptp_correction(ptp);
+        break;
+    case PTP_DELAY_RESP:
+        i = ntohs(ptp->ptp_seq) - q->seq0;
+        if (n >= (ssize_t) sizeof(*resp) && i < q->sent && q->dresp[i] == 0
+            && memcmp(&resp->requester, ptp_id(), sizeof(resp->requester)) == 0)
+            q->dresp[i] = ptp_ts_to_nsec(resp->ts) - ptp_correction(ptp);
+        break;
+    }
+}
+
+/*
+ * The PTP counterpart of recv_ntp_sample: take one message off either
+ * socket, 0 once it completes a sample, 1 if not and -1 when both are
+ * empty.  Only a Sync needs the kernel receive time.
+ */
+int ptp_recv(struct ntp_peer *peer, struct ntp_sample *sample)
+{
+    struct ntp_query *q = &peer->query;
+    char buf[BUFSIZE];
+    ssize_t n;
+    int64_t stamp = 0;
+
+    if (ptp_pair(q, sample))
+        return 0;
+    if ((n = recv(peer->gsockfd, buf, sizeof(buf), 0)) < 0
+        && (n = recv_stamped(peer->sockfd, buf, sizeof(buf), 0, NULL, NULL, &stamp)) < 0)
+        return -1;
+    ptp_message(q, buf, n, stamp);
+    return ptp_pair(q, sample) ? 0 : 1;
+}
+
+/*
+ * Sample records for -o/"record": fixed-width rows in host byte order,
+ * after a header of RECORD_MAGIC and the row size, so a reader can map
+ * the file straight into columns.  A file with another header is not
+ * appended to.  Rows are filled in place in a batch
+ * and written with a single write().
+ */
+struct ntp_record {
+    char        target[32];
+    uint32_t    addr;               /* IPv4, network byte order */
+    uint32_t    refid;
+    int64_t     t1, t2, t3, t4;     /* unix ns */
+    double      offset;
+    double      delay;
+    double      rootdelay;
+    double      rootdisp;
+    uint32_t    kod;
+    uint8_t     stratum;
+    uint8_t     li;
+    uint8_t     version;
+    uint8_t     valid;              /* 0 for a reply without usable time, offset and delay are 0 */
+};
+
+static struct ntp_record records[RECORD_BATCH];
+static int nrecords, recordfd = -1;
+
+int record_open(const char *path)
+{
+    uint32_t size = sizeof(struct ntp_record), old;
+    char magic[8];
+
+    if ((recordfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (lseek(recordfd, 0, SEEK_END) == 0)
+        return write(recordfd, RECORD_MAGIC, 8) != 8 || write(recordfd, &size, 4) != 4 ? -1 : 0;
+    if (pread(recordfd, magic, 8, 0) != 8 || pread(recordfd, &old, 4, 8) != 4
+        || memcmp(magic, RECORD_MAGIC, 8) != 0 || old != size)
+    {
+        close(recordfd);
+        recordfd = -1;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void record_flush(void)
+{
+    if (nrecords && recordfd >= 0
+        && write(recordfd, records, nrecords * sizeof(struct ntp_record)) < 0)
+        perror("record write error");
+    nrecords = 0;
+}
+
+/*
+ * Target state for "state": an open addressing table keyed by address
+ * and port in a mapped file, so it outlives the process.  Every answer
+ * that repeats the previous one within STATE_STABLE, from the same
+ * stratum and reference, raises the target's stability and doubles its
+ * interval up to STATE_BACKOFF times the poll; any change or a missed
+ * reply starts it over.  A key that finds no free slot within
+ * STATE_PROBE takes over the entry seen longest ago.
+ */
+struct ntp_state {
+    uint32_t    addr;               /* network byte order, 0 marks a free entry */
+    uint16_t    port;
+    uint8_t     stratum;
+    uint8_t     answered;
+    uint32_t    refid;
+    uint32_t    stability;
+    int64_t     seen;               /* unix ns of the last query */
+    double      offset;
+    double      delay;
+};
+
+struct ntp_state_file {
+    char                magic[8];
+    uint32_t            size;       /* STATE_SIZE */
+    uint32_t            entry;      /* sizeof(struct ntp_state) */
+    struct ntp_state    table[STATE_SIZE];
+};
+
+static struct ntp_state_file *statefile;
+
+int state_open(const char *path)
+{
+    struct ntp_state_file *f;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(*f)) != 0
+        || (f = mmap(NULL, sizeof(*f), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* a file from a build with another layout starts empty */
+    if (memcmp(f->magic, STATE_MAGIC, 8) != 0 || f->size != STATE_SIZE
+        || f->entry != sizeof(struct ntp_state))
+    {
+        memset(f, 0, sizeof(*f));
+        memcpy(f->magic, STATE_MAGIC, 8);
+        f->size = STATE_SIZE;
+        f->entry = sizeof(struct ntp_state);
+    }
+    statefile = f;
+    return 0;
+}
+
+struct ntp_state *state_lookup(uint32_t addr, uint16_t port)
+{
+    struct ntp_state *e, *victim = NULL;
+    uint32_t h;
+    int i;
+
+    if (statefile == NULL)
+        return NULL;
+
+    /* the top bits of a multiplicative hash are the well mixed ones */
+    h = (ntohl(addr) ^ (uint32_t) port << 16) * 2654435761u;
+    h = (uint32_t) ((uint64_t) h * STATE_SIZE >> 32);
+    for (i = 0; i < STATE_PROBE; i++)
+    {
+        e = &statefile->table[(h + i) & (STATE_SIZE - 1)];
+        if (e->addr == addr && e->port == port)
+            return e;
+        if (e->addr == 0)
+            break;
+        if (victim == NULL || e->seen < victim->seen)
+            victim = e;
+    }
+    if (i < STATE_PROBE)
+        victim = e;
+
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = addr;
+    victim->port = port;
+    return victim;
+}
+
+/* ns in a poll interval of 2^poll seconds, poll may be negative */
+int64_t poll_ns(int poll)
+{
+    return poll >= 0 ? (int64_t) 1000000000 << poll : 1000000000 >> -poll;
+}
+
+int state_due(const struct ntp_state *e, int poll, int64_t now)
+{
+    int backoff = e->stability < STATE_BACKOFF ? e->stability : STATE_BACKOFF;
+
+    return e->seen == 0 || now - e->seen >= poll_ns(poll + backoff);
+}
+
+void state_update(struct ntp_state *e, const struct ntp_sample *s, int answered)
+{
+    int stable = answered && e->answered && fabs(s->offset - e->offset) <= STATE_STABLE
+                 && s->stratum == e->stratum && s->refid == e->refid;
+
+    e->stability = stable ? e->stability + 1 : 0;
+    e->answered = answered;
+    if (answered)
+    {
+        e->offset = s->offset;
+        e->delay = s->delay;
+        e->stratum = s->stratum;
+        e->refid = s->refid;
+    }
+}
+
+/*
+ * Telemetry: records queue in a ring and leave in messages of up to
+ * TELEMETRY_BATCH, each a struct ntp_batch followed by the records, as
+ * one UDP datagram or back to back on a TCP stream.  The socket never
+ * blocks; while the collector is slow the ring fills and new records
+ * are dropped and counted instead of holding up the caller.
+ */
+struct ntp_batch {
+    char        magic[8];
+    char        host[32];           /* sender */
+    uint32_t    count;              /* records that follow */
+    uint32_t    dropped;            /* records lost so far */
+};
+
+struct ntp_telemetry {
+    struct sockaddr_in  addr;
+    int                 tcp;
+    int                 fd;
+    char                host[32];
+    struct ntp_record   ring[TELEMETRY_RING];
+    unsigned int        head;       /* next slot written */
+    unsigned int        tail;       /* next record sent */
+    uint32_t            dropped;
+    char                out[sizeof(struct ntp_batch) + TELEMETRY_BATCH * sizeof(struct ntp_record)];
+    size_t              outlen;     /* message being sent, 0 if none */
+    size_t              outoff;
+};
+
+static struct ntp_telemetry telemetry = { .fd = -1 };
+
+int telemetry_open(const struct ntp_conf *conf)
+{
+    memset(&telemetry.addr, 0, sizeof(telemetry.addr));
+    telemetry.addr.sin_family = AF_INET;
+    telemetry.addr.sin_port = htons(conf->collector_port);
+    if ((telemetry.addr.sin_addr.s_addr = inet_host(conf->collector)) == INADDR_NONE)
+        return -1;
+    telemetry.tcp = conf->collector_tcp;
+    gethostname(telemetry.host, sizeof(telemetry.host) - 1);
+    return 0;
+}
+
+void telemetry_push(const struct ntp_record *r)
+{
+    if (telemetry.addr.sin_port == 0)
+        return;
+    if (telemetry.head - telemetry.tail == TELEMETRY_RING)
+    {
+        telemetry.dropped++;
+        return;
+    }
+    telemetry.ring[telemetry.head++ % TELEMETRY_RING] = *r;
+}
+
+void telemetry_close(void)
+{
+    close(telemetry.fd);
+    telemetry.fd = -1;
+    /* a half sent message starts over on the next connection */
+    telemetry.outoff = 0;
+}
+
+/* send as much as the collector takes right now */
+void telemetry_flush(void)
+{
+    struct ntp_batch *hdr = (struct ntp_batch *) telemetry.out;
+    struct ntp_record *rec = (struct ntp_record *) (hdr + 1);
+    ssize_t n;
+    char c;
+    int i;
 
-    timeout.tv_sec = TIMEOUT;
-    timeout.tv_usec = 0;
+    if (telemetry.addr.sin_port == 0)
+        return;
 
-    if (select(maxfd1, &readfds, NULL, NULL, &timeout) > 0)
+    for (;;)
     {
-        if (FD_ISSET(sockfd, &readfds))
+        if (telemetry.outlen == 0)
+        {
+            if (telemetry.head == telemetry.tail)
+                return;
+            memcpy(hdr->magic, TELEMETRY_MAGIC, 8);
+            memcpy(hdr->host, telemetry.host, sizeof(hdr->host));
+            hdr->dropped = telemetry.dropped;
+            for (i = 0; i < TELEMETRY_BATCH && telemetry.tail != telemetry.head; i++)
+                rec[i] = telemetry.ring[telemetry.tail++ % TELEMETRY_RING];
+            hdr->count = i;
+            telemetry.outlen = sizeof(*hdr) + i * sizeof(*rec);
+            telemetry.outoff = 0;
+        }
+
+        /* the collector closes idle connections, find out before a message is lost in one */
+        if (telemetry.tcp && telemetry.fd >= 0 && telemetry.outoff == 0
+            && recv(telemetry.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+            telemetry_close();
+
+        if (telemetry.fd < 0)
         {
-            if ((nbytes = recv(sockfd, buf, BUFSIZE, 0)) < 0)
+            if ((telemetry.fd = socket(AF_INET, (telemetry.tcp ? SOCK_STREAM : SOCK_DGRAM)
+                                       | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+                return;
+            if (connect(telemetry.fd, (struct sockaddr *) &telemetry.addr, sizeof(telemetry.addr)) != 0
+                && errno != EINPROGRESS)
             {
-                perror("recv error");
-                exit(-1);
+                telemetry_close();
+                return;
             }
+        }
 
-            gettimeofday(&recvtv, NULL);
-            offset = get_offset((struct ntphdr *) buf, &recvtv);
+        n = send(telemetry.fd, telemetry.out + telemetry.outoff, telemetry.outlen - telemetry.outoff,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == ENOTCONN))
+            return;
+        if (n < 0)
+        {
+            telemetry_close();
+            if (telemetry.tcp)
+                return;
+            /* the collector is not there, this message is lost */
+            telemetry.dropped += hdr->count;
+            telemetry.outlen = 0;
+            return;
+        }
+
+        telemetry.outoff += n;
+        if (telemetry.outoff < telemetry.outlen)
+            return;
+        telemetry.outlen = 0;
+    }
+}
+
+/* one-shot runs wait up to timeout ms for the collector to take everything */
+void telemetry_drain(int timeout)
+{
+    struct pollfd pfd;
+    int64_t end = now_ns(CLOCK_MONOTONIC) + (int64_t) timeout * 1000000;
+
+    for (telemetry_flush(); telemetry.fd >= 0 && (telemetry.outlen || telemetry.head != telemetry.tail);
+         telemetry_flush())
+    {
+        pfd.fd = telemetry.fd;
+        pfd.events = POLLOUT;
+        if ((timeout = (end - now_ns(CLOCK_MONOTONIC)) / 1000000) <= 0 || poll(&pfd, 1, timeout) <= 0)
+            return;
+    }
+}
+
+void record_add(const struct ntp_peer *peer, const struct ntp_sample *sample)
+{
+    struct ntp_record tmp, *r;
+
+    if (recordfd < 0 && telemetry.addr.sin_port == 0)
+        return;
+
+    r = recordfd >= 0 ? &records[nrecords] : &tmp;
+    memset(r, 0, sizeof(*r));
+    memcpy(r->target, peer->conf->host, strnlen(peer->conf->host, sizeof(r->target) - 1));
+    r->addr = peer->addr.sin_addr.s_addr;
+    r->refid = sample->refid;
+    r->t1 = sample->t1;
+    r->t2 = sample->t2;
+    r->t3 = sample->t3;
+    r->t4 = sample->t4;
+    r->offset = sample->offset;
+    r->delay = sample->delay;
+    r->rootdelay = sample->rootdelay;
+    r->rootdisp = sample->rootdisp;
+    r->kod = sample->kod;
+    r->stratum = sample->stratum;
+    r->li = sample->li;
+    r->version = sample->version;
+    r->valid = (uint8_t) sample->valid;
+
+    telemetry_push(r);
+    if (recordfd >= 0 && ++nrecords == RECORD_BATCH)
+        record_flush();
+}
 
-            gettimeofday(&tv, NULL);
-            tv.tv_sec += (int) offset;
-            tv.tv_usec += offset - (int) offset;
+/* the k-th smallest of v[0..n-1], reordering v (quickselect) */
+double select_kth(double *v, int n, int k)
+{
+    double pivot, t;
+    int lo = 0, hi = n - 1, i, j;
 
-            if (settimeofday(&tv, NULL) != 0)
+    while (lo < hi)
+    {
+        pivot = v[lo + (hi - lo) / 2];
+        for (i = lo, j = hi; i <= j; )
+        {
+            while (v[i] < pivot)
+                i++;
+            while (v[j] > pivot)
+                j--;
+            if (i <= j)
             {
-                perror("settimeofday error");
-                exit(-1);
+                t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
             }
-            printf("Server: %s\n", argv[1]);
-            printf("%s", ctime((time_t *) &tv.tv_sec));
         }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
     }
+    return v[k];
+}
+
+double median(double *v, int n)
+{
+    return select_kth(v, n, n / 2);
+}
+
+/*
+ * Consensus over the peers' latest answers.  Each finished query inserts
+ * its sample into votes[], kept sorted by offset, so the weighted median
+ * is a single scan whenever it is asked for.  Votes are weighted by the
+ * inverse root distance, the error bound a server claims for itself.  A
+ * vote stands across rounds until the peer's next answer replaces it or
+ * it is CONSENSUS_POLLS poll intervals old, so a slow server still
+ * counts against one polled many times a second.
+ */
+struct ntp_vote {
+    double              offset;
+    double              weight;
+    double              distance;
+    int64_t             time;       /* CLOCK_MONOTONIC ns it was cast */
+    struct ntp_peer     *peer;
+};
+
+static struct ntp_vote votes[CONF_MAX_SERVERS];
+static int nvotes;
+static int quiet;                   /* the round prints nothing, set by compute_round */
+
+/*
+ * Root distance: half the path to the reference plus its dispersion.  A
+ * delay measured below zero (asymmetric stamps on a short path) counts
+ * as none, so the distance and the vote weight stay positive.
+ */
+double root_distance(const struct ntp_sample *s)
+{
+    return (s->rootdelay + (s->delay > 0 ? s->delay : 0)) / 2 + s->rootdisp + MIN_DISPERSION;
+}
+
+void consensus_remove(const struct ntp_peer *peer)
+{
+    int i;
 
-    close(sockfd);
+    for (i = 0; i < nvotes; i++)
+        if (votes[i].peer == peer)
+        {
+            memmove(&votes[i], &votes[i + 1], (nvotes - i - 1) * sizeof(votes[0]));
+            nvotes--;
+            return;
+        }
+}
+
+void consensus_add(struct ntp_peer *peer)
+{
+    int i;
+
+    consensus_remove(peer);
+    if (peer->conf->mesh)
+        return;
+
+    for (i = nvotes; i > 0 && votes[i - 1].offset > peer->sample.offset; i--)
+        votes[i] = votes[i - 1];
+    votes[i].offset = peer->sample.offset;
+    votes[i].distance = root_distance(&peer->sample);
+    votes[i].weight = 1 / votes[i].distance;
+    votes[i].time = now_ns(CLOCK_MONOTONIC);
+    votes[i].peer = peer;
+    nvotes++;
+}
+
+/* drop the votes their peers have not renewed for CONSENSUS_POLLS of their poll intervals */
+void consensus_expire(const struct ntp_conf *conf, int64_t now)
+{
+    const struct ntp_server_conf *srv;
+    int i, poll;
+
+    for (i = 0; i < nvotes; )
+    {
+        srv = votes[i].peer->conf;
+        poll = srv->poll == POLL_GLOBAL ? conf->poll : srv->poll;
+        if (now - votes[i].time <= CONSENSUS_POLLS * poll_ns(poll + (statefile ? STATE_BACKOFF : 0)))
+        {
+            i++;
+            continue;
+        }
+        votes[i].peer->falseticker = 0;
+        memmove(&votes[i], &votes[i + 1], (nvotes - i - 1) * sizeof(votes[0]));
+        nvotes--;
+    }
+}
+
+/* the clock was corrected by offset, so every standing vote is that much nearer */
+void consensus_shift(double offset)
+{
+    int i;
+
+    for (i = 0; i < nvotes; i++)
+        votes[i].offset -= offset;
+}
+
+/* start over from the peers' fresh samples, after a reload */
+void consensus_reset(struct ntp_peer *peers, int npeers)
+{
+    int i;
+
+    nvotes = 0;
+    for (i = 0; i < npeers; i++)
+    {
+        peers[i].falseticker = 0;
+        if (peers[i].valid)
+            consensus_add(&peers[i]);
+    }
+}
+
+/*
+ * The weighted median offset and the median absolute deviation around
+ * it.  A peer whose offset, widened by its own root distance, still
+ * misses the median by more than CONSENSUS_MAD sigmas is marked a
+ * falseticker.  Returns the number of votes.
+ */
+int consensus(double *offset, double *mad)
+{
+    double dev[CONF_MAX_SERVERS], total = 0, sum = 0, sigma;
+    int i;
+
+    if (nvotes == 0)
+        return 0;
+    for (i = 0; i < nvotes; i++)
+        total += votes[i].weight;
+    /* rounding can leave the sum a hair short of half, stop at the last vote */
+    for (i = 0; i < nvotes - 1; i++)
+        if ((sum += votes[i].weight) >= total / 2)
+            break;
+    *offset = votes[i].offset;
+
+    for (i = 0; i < nvotes; i++)
+        dev[i] = fabs(votes[i].offset - *offset);
+    *mad = median(dev, nvotes);
+
+    sigma = CONSENSUS_MAD * MAD_SIGMA * *mad;
+    for (i = 0; i < nvotes; i++)
+        votes[i].peer->falseticker = nvotes >= CONSENSUS_MIN
+                                     && fabs(votes[i].offset - *offset) - votes[i].distance > sigma;
+    return nvotes;
+}
+
+void consensus_report(void)
+{
+    double offset, mad;
+    int i, n, nfalse = 0;
+
+    if ((n = consensus(&offset, &mad)) == 0 || quiet)
+        return;
+    for (i = 0; i < n; i++)
+        nfalse += votes[i].peer->falseticker;
+    printf("consensus offset %lf mad %lf truechimers %d/%d \n", offset, mad, n - nfalse, n);
+    for (i = 0; i < n; i++)
+        if (votes[i].peer->falseticker)
+            printf("falseticker %s offset %lf distance %lf \n", votes[i].peer->conf->host,
+                   votes[i].offset, votes[i].distance);
+}
+
+/*
+ * The resident instance runs on two threads.  The I/O loop in main()
+ * only moves and stamps packets; everything else (records, telemetry,
+ * consensus, selection, setting the clock, reports) happens on the
+ * compute thread.  Samples travel there as events on a single producer,
+ * single consumer ring and sync updates come back on another, each
+ * side only ever advancing its own index, so neither waits on the
+ * other.  An eventfd per direction wakes the reader.
+ */
+struct ntp_spsc {
+    _Atomic uint32_t    head;       /* advanced by the producer only */
+    char                pad[60];    /* keep the two indexes on separate cache lines */
+    _Atomic uint32_t    tail;       /* advanced by the consumer only */
+};
+
+/* the slot to fill next, or -1 when the ring is full */
+int spsc_reserve(struct ntp_spsc *r, uint32_t size)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == size)
+        return -1;
+    return head & (size - 1);
+}
+
+void spsc_commit(struct ntp_spsc *r)
+{
+    atomic_store_explicit(&r->head, atomic_load_explicit(&r->head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/* the oldest filled slot, or -1 when the ring is empty */
+int spsc_peek(struct ntp_spsc *r, uint32_t size)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+        return -1;
+    return tail & (size - 1);
+}
+
+void spsc_release(struct ntp_spsc *r)
+{
+    atomic_store_explicit(&r->tail, atomic_load_explicit(&r->tail, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+enum { EV_SAMPLE, EV_RESULT, EV_ROUND, EV_RESET, EV_STOP };
+
+/* the peer's address and configuration travel along, the compute side keeps its own copies */
+/* only what the compute thread reads of the server, host cut to EVENT_HOST */
+struct ntp_event {
+    int                     type;
+    struct sockaddr_in      addr;
+    char                    host[EVENT_HOST];
+    int                     vsock;
+    int                     ptp;
+    int                     mesh;
+    int                     poll;
+    struct ntp_sample       sample;
+};
+
+static struct ntp_spsc evring, cmdring;
+static struct ntp_event events[EVENT_RING];
+static struct ntp_sync commands[COMMAND_RING];
+static int evfd = -1, cmdfd = -1, evpending;
+static _Atomic uint32_t evdropped;
+
+void event_push(int type, const struct ntp_peer *peer, const struct ntp_sample *sample)
+{
+    struct ntp_event *ev;
+    size_t n;
+    int i;
+
+    if ((i = spsc_reserve(&evring, EVENT_RING)) < 0)
+    {
+        atomic_fetch_add_explicit(&evdropped, 1, memory_order_relaxed);
+        return;
+    }
+    ev = &events[i];
+    ev->type = type;
+    if (peer)
+    {
+        ev->addr = peer->addr;
+        n = strnlen(peer->conf->host, sizeof(ev->host) - 1);
+        memcpy(ev->host, peer->conf->host, n);
+        ev->host[n] = 0;
+        ev->vsock = peer->conf->vsock;
+        ev->ptp = peer->conf->ptp;
+        ev->mesh = peer->conf->mesh;
+        ev->poll = peer->conf->poll;
+    }
+    if (sample)
+        ev->sample = *sample;
+    spsc_commit(&evring);
+    evpending = 1;
+}
+
+/*
+ * Wake the compute thread once for everything pushed since the last call,
+ * so a fast poll costs one eventfd write per loop rather than per event.
+ */
+void event_notify(void)
+{
+    if (evpending && evfd >= 0)
+        eventfd_write(evfd, 1);
+    evpending = 0;
+}
+
+/* tell the compute side the peer set changed, keeping the fresh samples */
+void peers_publish(const struct ntp_peer *peers, int npeers)
+{
+    int i;
+
+    event_push(EV_RESET, NULL, NULL);
+    for (i = 0; i < npeers; i++)
+        if (peers[i].valid)
+            event_push(EV_RESULT, &peers[i], &peers[i].sample);
+}
+
+void peer_close(struct ntp_peer *peer)
+{
+    if (peer->sockfd >= 0)
+        close(peer->sockfd);
+    if (peer->ptp && peer->gsockfd >= 0)
+        close(peer->gsockfd);
+    peer->sockfd = -1;
+    peer->gsockfd = -1;
+    peer->connecting = 0;
+}
+
+/*
+ * A PTP master sends event messages to port 319 and general ones to 320,
+ * so against a standard master the client needs those very ports (and
+ * root).  On any other port it takes an ephemeral pair, event port p and
+ * general p + 1, which is what the bundled ptpmaster answers to.
+ */
+int ptp_connect(struct ntp_peer *peer)
+{
+    struct sockaddr_in local, general = peer->addr;
+    socklen_t len = sizeof(local);
+    int i;
+
+    for (i = 0; i < PTP_BIND_TRIES; i++)
+    {
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        if (peer->addr.sin_port == htons(PTP_EVENT_PORT))
+            local.sin_port = peer->addr.sin_port;
+        peer->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        peer->gsockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (peer->sockfd >= 0 && peer->gsockfd >= 0
+            && bind(peer->sockfd, (struct sockaddr *) &local, sizeof(local)) == 0
+            && getsockname(peer->sockfd, (struct sockaddr *) &local, &len) == 0
+            && (local.sin_port = htons(ntohs(local.sin_port) + 1)) != 0
+            && bind(peer->gsockfd, (struct sockaddr *) &local, sizeof(local)) == 0)
+            break;
+        peer_close(peer);
+    }
+    if (i == PTP_BIND_TRIES)
+        return -1;
+
+    general.sin_port = htons(ntohs(peer->addr.sin_port) + 1);
+    if (enable_rx_timestamps(peer->sockfd) != 0
+        || connect(peer->sockfd, (struct sockaddr *) &peer->addr, sizeof(peer->addr)) != 0
+        || connect(peer->gsockfd, (struct sockaddr *) &general, sizeof(general)) != 0)
+    {
+        peer_close(peer);
+        return -1;
+    }
+    return 0;
+}
+
+/* open the peer's socket, connected to its address */
+int peer_connect(struct ntp_peer *peer)
+{
+    struct sockaddr_vm vm;
+
+    if (peer->ptp)
+        return ptp_connect(peer);
+    if (!peer->stream)
+    {
+        if ((peer->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+            return -1;
+        if (enable_rx_timestamps(peer->sockfd) != 0
+            || connect(peer->sockfd, (struct sockaddr *) &peer->addr, sizeof(struct sockaddr)) != 0)
+        {
+            close(peer->sockfd);
+            peer->sockfd = -1;
+            return -1;
+        }
+        return 0;
+    }
+
+    /* an unreachable CID can take seconds to refuse, so the connect finishes on POLLOUT */
+    memset(&vm, 0, sizeof(vm));
+    vm.svm_family = AF_VSOCK;
+    vm.svm_cid = ntohl(peer->addr.sin_addr.s_addr);
+    vm.svm_port = ntohs(peer->addr.sin_port);
+
+    if ((peer->sockfd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+    if (connect(peer->sockfd, (struct sockaddr *) &vm, sizeof(vm)) != 0)
+    {
+        if (errno == EINPROGRESS)
+        {
+            peer->connecting = 1;
+            return 0;
+        }
+        close(peer->sockfd);
+        peer->sockfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* 0 once a pending vsock connect is through, 1 while it still runs, -1 if it failed */
+int peer_connected(struct ntp_peer *peer)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (!peer->connecting)
+        return 0;
+    pfd.fd = peer->sockfd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) == 0)
+        return 1;
+    if (getsockopt(peer->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+    {
+        errno = err ? err : errno;
+        return -1;
+    }
+    peer->connecting = 0;
+    return 0;
+}
+
+/*
+ * The client core is a set of non-blocking queries, one per peer.  A
+ * caller's event loop drives them: start a burst with query_start(),
+ * call query_send() when the time it returned is reached and
+ * query_recv() when the peer's socket is readable.  query_run() is the
+ * built-in loop for one-shot use.
+ */
+void query_start(struct ntp_peer *peer, int64_t now)
+{
+    struct ntp_query *q = &peer->query;
+
+    if (peer->sockfd < 0)
+    {
+        if (peer_connect(peer) != 0)
+        {
+            fprintf(stderr, "no connection to %s \n", peer->conf->host);
+            peer_close(peer);
+            peer->valid = 0;
+            return;
+        }
+        if (peer->txtime && enable_txtime(peer->sockfd) != 0)
+        {
+            perror("SO_TXTIME unavailable, pacing with clock_nanosleep");
+            peer->txtime = 0;
+        }
+    }
+
+    q->active = 1;
+    q->sent = 0;
+    q->received = 0;
+    q->limit = peer->conf->burst;
+    memset(q->txstamp, 0, sizeof(q->txstamp));
+    q->next = now + (peer->txtime ? TXTIME_LEAD : 0);
+    q->deadline = q->next + (int64_t) (q->limit - 1) * peer->conf->interval * 1000000;
+    peer->valid = 0;
+}
+
+void query_finish(struct ntp_peer *peer)
+{
+    struct ntp_query *q = &peer->query;
+    int i;
+
+    q->active = 0;
+    if (peer->txtime)
+    {
+        txtime_check(peer);
+        for (i = 0; i < q->sent && q->txstamp[i] == 0; i++)
+            ;
+        if (q->sent && i == q->sent)
+            txtime_off(peer, "no request got as far as the driver");
+    }
+    if (peer->state)
+        state_update(peer->state, &q->best, q->received != 0);
+    if (q->received)
+        peer->delays[peer->ndelays++ % BURST_HISTORY] = q->best.delay;
+    if (q->received == 0)
+    {
+        fprintf(stderr, "no reply from %s \n", peer->conf->host);
+        return;
+    }
+    peer->sample = q->best;
+    peer->valid = 1;
+    event_push(EV_RESULT, peer, &peer->sample);
+}
+
+/*
+ * Send the requests of the burst that are due, interval ms apart.  With
+ * txtime the kernel releases each at its slot (needs an ETF qdisc),
+ * otherwise the last PACE_SLACK of the wait is slept here.  Returns when
+ * the query next needs attention, or -1 once it is finished.
+ */
+int64_t query_send(struct ntp_peer *peer, int timeout, int64_t now)
+{
+    struct ntp_query *q = &peer->query;
+    const struct ntp_server_conf *srv = peer->conf;
+    char buf[BUFSIZE];
+    size_t nbytes;
+    struct timespec ts;
+    int64_t lead = peer->txtime ? TXTIME_LEAD : PACE_SLACK, giveup;
+    int ret;
+
+    if (!q->active)
+        return -1;
+
+    /* the burst waits for a pending vsock connect, up to timeout */
+    if (peer->connecting)
+    {
+        giveup = q->next + (int64_t) timeout * 1000000000;
+        if ((ret = peer_connected(peer)) > 0 && now < giveup)
+            return giveup;
+        if (ret != 0)
+        {
+            fprintf(stderr, "no connection to %s \n", srv->host);
+            peer_close(peer);
+            q->active = 0;
+            return -1;
+        }
+        q->next = now;
+    }
+
+    while (q->sent < q->limit && now >= q->next - lead)
+    {
+        if (!peer->txtime)
+        {
+            ts.tv_sec = q->next / 1000000000;
+            ts.tv_nsec = q->next % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        if (peer->ptp)
+            ret = ptp_send(peer);
+        else
+        {
+            nbytes = BUFSIZE;
+            get_ntp_packet(buf, &nbytes, srv->version);
+            ret = send_ntp_packet(peer->sockfd, buf, nbytes,
+                                  peer->txtime ? q->next + now_ns(CLOCK_TAI) - now_ns(CLOCK_MONOTONIC) : 0);
+            q->xmt[q->sent] = ((struct ntphdr *) buf)->ntp_transts;
+        }
+        if (ret < 0)
+            perror("send error");
+        q->sent++;
+
+        q->next += (int64_t) srv->interval * 1000000;
+        /* a sub-second poll cannot wait longer than its interval */
+        if (q->sent == q->limit)
+            q->deadline = now + (peer->period && peer->period < (int64_t) timeout * 1000000000
+                                 ? peer->period : (int64_t) timeout * 1000000000);
+        now = now_ns(CLOCK_MONOTONIC);
+    }
+
+    if (q->received >= q->limit || (q->sent >= q->limit && now >= q->deadline))
+    {
+        query_finish(peer);
+        return -1;
+    }
+    return q->sent < q->limit ? q->next - lead : q->deadline;
+}
+
+/*
+ * Adaptive bursts.  The floor is the lowest best delay of the peer's
+ * recent bursts, or the last one kept in the state file after a restart:
+ * a reply within BURST_EPSILON of it can hardly be bettered, so the
+ * burst ends there.  A burst that is about to end with
+ * its delays spread wider than BURST_SPREAD times the floor is on a
+ * noisy path and gets one more request, up to BURST_MAX.
+ */
+void burst_adapt(struct ntp_peer *peer, double delay)
+{
+    struct ntp_query *q = &peer->query;
+    double floor = 0;
+    unsigned int i, n = peer->ndelays < BURST_HISTORY ? peer->ndelays : BURST_HISTORY;
+
+    for (i = 0; i < n; i++)
+        if (i == 0 || peer->delays[i] < floor)
+            floor = peer->delays[i];
+    if (n == 0 && peer->state && peer->state->answered)
+    {
+        floor = peer->state->delay;
+        n = 1;
+    }
+
+    q->dmin = q->received == 1 || delay < q->dmin ? delay : q->dmin;
+    q->dmax = q->received == 1 || delay > q->dmax ? delay : q->dmax;
+
+    if (n && delay <= floor * (1 + BURST_EPSILON) + BURST_EPSILON_ABS)
+        q->limit = q->received;
+    else if (q->received >= q->limit && q->limit < BURST_MAX
+             && q->dmax - q->dmin > BURST_SPREAD * (n ? floor : q->dmin))
+        q->limit++;
+}
+
+/*
+ * Drain the replies queued on the peer's socket, keeping the lowest
+ * delay.  Returns how many packets were read.
+ */
+int query_recv(struct ntp_peer *peer)
+{
+    struct ntp_query *q = &peer->query;
+    struct ntp_sample sample;
+    int ret, n = 0;
+
+    if (peer->conf->txtime)
+        txtime_check(peer);
+    while ((ret = peer->ptp ? ptp_recv(peer, &sample)
+                            : recv_ntp_sample(peer->sockfd, peer->stream, q, &sample)) >= 0)
+    {
+        n++;
+        if (ret != 1)
+            event_push(EV_SAMPLE, peer, &sample);
+        if (ret == 0 && timing.first == 0)
+            timing.first = now_ns(CLOCK_MONOTONIC);
+        if (ret != 0 || !q->active)
+            continue;
+        if (q->received == 0 || sample.delay < q->best.delay)
+            q->best = sample;
+        q->received++;
+        if (peer->conf->adaptive)
+            burst_adapt(peer, sample.delay);
+        if (q->received >= q->limit)
+            query_finish(peer);
+    }
+
+    /* the next query reconnects */
+    if (ret == -2)
+    {
+        close(peer->sockfd);
+        peer->sockfd = -1;
+    }
+    return n;
+}
+
+/*
+ * Built-in reactor: run the active queries until quorum peers have a
+ * fresh sample or none is left running.  Returns the number answered.
+ */
+int query_run(struct ntp_peer *peers, int npeers, int quorum, int timeout)
+{
+    struct pollfd pfd[2 * CONF_MAX_SERVERS];
+    struct timespec ts;
+    int64_t now, wake, next;
+    int i, answered;
+
+    for (;;)
+    {
+        now = now_ns(CLOCK_MONOTONIC);
+        wake = -1;
+        answered = 0;
+        for (i = 0; i < npeers; i++)
+        {
+            if ((next = query_send(&peers[i], timeout, now)) >= 0 && (wake < 0 || next < wake))
+                wake = next;
+            answered += peers[i].valid;
+            pfd[i].fd = peers[i].query.active ? peers[i].sockfd : -1;
+            pfd[i].events = peers[i].connecting ? POLLOUT : POLLIN;
+            pfd[npeers + i].fd = peers[i].query.active && peers[i].ptp ? peers[i].gsockfd : -1;
+            pfd[npeers + i].events = POLLIN;
+        }
+        if (wake < 0 || answered >= quorum)
+            return answered;
+
+        wake = wake > now ? wake - now : 0;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        if (ppoll(pfd, 2 * npeers, &ts, NULL) > 0)
+            for (i = 0; i < npeers; i++)
+                if ((pfd[i].revents || pfd[npeers + i].revents) && !peers[i].connecting)
+                    query_recv(&peers[i]);
+    }
+}
+
+/* step the clock by offset, or with slew have adjtime() run it in gradually */
+int apply_offset(double offset, int slew)
+{
+    struct timeval tv;
+    char date[32];
+    long usec;
+
+    if (slew)
+    {
+        tv.tv_sec = (long) offset;
+        tv.tv_usec = (long) ((offset - tv.tv_sec) * 1000000);
+        if (adjtime(&tv, NULL) != 0)
+            return -1;
+        gettimeofday(&tv, NULL);
+        if (!quiet)
+            printf("%s", ctime_r(&tv.tv_sec, date));
+        return 0;
+    }
+
+    gettimeofday(&tv, NULL);
+    usec = tv.tv_usec + (long) ((offset - (long) offset) * 1000000);
+    tv.tv_sec += (long) offset + usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+    if (tv.tv_usec < 0)
+    {
+        tv.tv_sec--;
+        tv.tv_usec += 1000000;
+    }
+
+    if (settimeofday(&tv, NULL) != 0)
+        return -1;
+
+    if (!quiet)
+        printf("%s", ctime_r(&tv.tv_sec, date));
+    return 0;
+}
+
+int conf_add_server(struct ntp_conf *conf, const struct ntp_server_conf *defaults,
+                    const char *host, in_addr_t addr)
+{
+    struct ntp_server_conf *srv;
+
+    if (conf->nservers >= CONF_MAX_SERVERS)
+        return -1;
+
+    srv = &conf->servers[conf->nservers++];
+    *srv = *defaults;
+    snprintf(srv->host, sizeof(srv->host), "%s", host);
+    srv->addr = addr;
+
+    return 0;
+}
+
+/*
+ * Parse one "server"/"pool" line after the keyword:
+ *   server <host|vsock:cid|ptp:host> [port N] [version N] [burst N] [interval ms]
+ *          [txtime] [adaptive] [trusted] [poll N]
+ * A pool adds every address its name resolves to.  Only a trusted server
+ * may have a negative poll, it is asked up to 16 times a second.
+ */
+int conf_parse_server(struct ntp_conf *conf, const struct ntp_server_conf *defaults,
+                      char *args, int pool)
+{
+    struct ntp_server_conf srv = *defaults;
+    struct hostent *hostent;
+    char *host, *name, *key, *val;
+    int64_t t;
+    int i, port = 0;
+
+    if ((host = strtok(args, " \t")) == NULL)
+        return -1;
+
+    while ((key = strtok(NULL, " \t")) != NULL)
+    {
+        if (strcmp(key, "txtime") == 0)
+        {
+            srv.txtime = 1;
+            continue;
+        }
+        if (strcmp(key, "adaptive") == 0)
+        {
+            srv.adaptive = 1;
+            continue;
+        }
+        if (strcmp(key, "trusted") == 0)
+        {
+            srv.trusted = 1;
+            continue;
+        }
+        if ((val = strtok(NULL, " \t")) == NULL)
+            return -1;
+
+        if (strcmp(key, "port") == 0)
+            srv.port = port = atoi(val);
+        else if (strcmp(key, "version") == 0)
+            srv.version = atoi(val);
+        else if (strcmp(key, "burst") == 0)
+            srv.burst = atoi(val);
+        else if (strcmp(key, "interval") == 0)
+            srv.interval = atoi(val);
+        else if (strcmp(key, "poll") == 0)
+            srv.poll = atoi(val);
+        else
+            return -1;
+    }
+
+    if (srv.burst < 1 || srv.burst > BURST_MAX || srv.interval < 0
+        || srv.version < VERSION_3 || srv.version > VERSION_4
+        || (srv.poll != POLL_GLOBAL && (srv.poll < (srv.trusted ? POLL_MIN : 0) || srv.poll > POLL_MAX)))
+        return -1;
+
+    /* vsock:<cid> queries the hypervisor host or another VM directly */
+    if (strncmp(host, "vsock:", 6) == 0 && !pool)
+    {
+        srv.vsock = 1;
+        srv.txtime = 0;
+        return conf_add_server(conf, &srv, host, htonl(strtoul(host + 6, NULL, 10)));
+    }
+
+    /* ptp:<host> is a PTP master, port is its event port */
+    name = host;
+    if (strncmp(host, "ptp:", 4) == 0)
+    {
+        srv.ptp = 1;
+        srv.txtime = 0;
+        srv.port = port ? port : PTP_EVENT_PORT;
+        name = host + 4;
+    }
+
+    if (!pool)
+    {
+        if ((srv.addr = inet_host(name)) == INADDR_NONE)
+            return -1;
+        return conf_add_server(conf, &srv, host, srv.addr);
+    }
+
+    t = now_ns(CLOCK_MONOTONIC);
+    hostent = gethostbyname(name);
+    timing.dns += now_ns(CLOCK_MONOTONIC) - t;
+    if (hostent == NULL)
+        return -1;
+    for (i = 0; hostent->h_addr_list[i] != NULL; i++)
+    {
+        memmove(&srv.addr, hostent->h_addr_list[i], sizeof(in_addr_t));
+        if (conf_add_server(conf, &srv, host, srv.addr) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * "smear <leap unix time> <window seconds> [linear|cosine]"
+ * The curve is sampled once here so serving only interpolates.
+ */
+int smear_init(struct ntp_smear *smear, char *args)
+{
+    char *leap, *window, *curve;
+    double x;
+    int i;
+
+    leap = strtok(args, " \t");
+    window = strtok(NULL, " \t");
+    curve = strtok(NULL, " \t");
+    if (leap == NULL || window == NULL || (curve && strcmp(curve, "linear") && strcmp(curve, "cosine")))
+        return -1;
+
+    /* the kernel only inserts a leap second at midnight UTC */
+    smear->leap = atoll(leap);
+    if ((smear->window = atoi(window)) < SMEAR_STEPS || smear->leap % 86400 != 0)
+        return -1;
+
+    for (i = 0; i <= SMEAR_STEPS; i++)
+    {
+        x = (double) i / SMEAR_STEPS;
+        smear->table[i] = curve && strcmp(curve, "cosine") == 0 ? (1 - cos(M_PI * x)) / 2 : x;
+    }
+    return 0;
+}
+
+/*
+ * Offset in usec to add to the local clock, in which the kernel inserts
+ * the leap second (repeating leap - 1, see leap_arm()).  Outside the
+ * window this is one comparison, inside one table lookup and
+ * interpolation.
+ */
+int64_t smear_offset(const struct ntp_smear *smear, int64_t usec)
+{
+    int64_t start, elapsed, span, leap;
+    struct timex tx;
+    double f, v;
+    int i, after;
+
+    if (smear->window == 0)
+        return 0;
+
+    leap = smear->leap * 1000000;
+    start = leap - (int64_t) smear->window * 500000;
+    span = ((int64_t) smear->window + 1) * 1000000;
+    if (usec < start || usec >= start + span)
+        return 0;
+
+    after = usec >= leap;
+    /* the repeated second can only be told apart by the kernel state */
+    if (!after && usec >= leap - 1000000)
+    {
+        memset(&tx, 0, sizeof(tx));
+        after = adjtimex(&tx) == TIME_OOP;
+    }
+
+    elapsed = usec - start + (after ? 1000000 : 0);
+    if (elapsed >= span)
+        return 0;
+
+    f = (double) elapsed * SMEAR_STEPS / span;
+    i = (int) f;
+    v = smear->table[i] + (smear->table[i + 1] - smear->table[i]) * (f - i);
+
+    return (after ? 1000000 : 0) - (int64_t) (v * 1000000);
+}
+
+/* "collector <host> <port> [udp|tcp]" */
+int conf_parse_collector(struct ntp_conf *conf, char *args)
+{
+    char *host, *port, *proto;
+
+    host = strtok(args, " \t");
+    port = strtok(NULL, " \t");
+    proto = strtok(NULL, " \t");
+    if (host == NULL || port == NULL || (proto && strcmp(proto, "udp") && strcmp(proto, "tcp")))
+        return -1;
+
+    snprintf(conf->collector, sizeof(conf->collector), "%s", host);
+    conf->collector_port = atoi(port);
+    conf->collector_tcp = proto && strcmp(proto, "tcp") == 0;
+    return 0;
+}
+
+/*
+ * Load a configuration file on top of the settings in base.
+ * poll/timeout/panic are global, burst/interval/txtime set the defaults
+ * for the server and pool lines that follow them.
+ */
+int conf_load(const char *path, const struct ntp_conf *base, const struct ntp_server_conf *defaults,
+              struct ntp_conf *conf)
+{
+    static char text[CONF_SIZE];
+    char *line, *next, *key, *args;
+    struct ntp_server_conf srv = *defaults, mesh;
+    ssize_t len, n;
+    int fd, lineno = 0, ret = 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    for (len = 0; len < CONF_SIZE - 1 && (n = read(fd, text + len, CONF_SIZE - 1 - len)) > 0; len += n)
+        ;
+    close(fd);
+    if (len == CONF_SIZE - 1)
+    {
+        fprintf(stderr, "%s: larger than %d bytes \n", path, CONF_SIZE - 1);
+        return -1;
+    }
+    text[len] = '\0';
+
+    *conf = *base;
+    conf->nservers = 0;
+
+    for (line = text; ret == 0 && line != NULL && *line; line = next)
+    {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        lineno++;
+        line[strcspn(line, "#\r")] = '\0';
+        if ((key = strtok(line, " \t")) == NULL)
+            continue;
+        args = strtok(NULL, "");
+
+        if (strcmp(key, "server") == 0 || strcmp(key, "pool") == 0 || strcmp(key, "mesh") == 0)
+        {
+            mesh = srv;
+            mesh.mesh = key[0] == 'm';
+            ret = args ? conf_parse_server(conf, &mesh, args, key[0] == 'p') : -1;
+        }
+        else if (strcmp(key, "meshprobe") == 0 && args)
+            conf->meshprobe = atoi(args);
+        else if (strcmp(key, "txtime") == 0)
+            srv.txtime = 1;
+        else if (strcmp(key, "adaptive") == 0)
+            srv.adaptive = 1;
+        else if (strcmp(key, "perf") == 0)
+            conf->perf = 1;
+        else if (args == NULL)
+            ret = -1;
+        else if (strcmp(key, "poll") == 0)
+            conf->poll = atoi(args);
+        else if (strcmp(key, "timeout") == 0)
+            conf->timeout = atoi(args);
+        else if (strcmp(key, "panic") == 0)
+            conf->panic = atof(args);
+        else if (strcmp(key, "quorum") == 0)
+            conf->quorum = atoi(args);
+        else if (strcmp(key, "record") == 0)
+            snprintf(conf->record, sizeof(conf->record), "%s", args);
+        else if (strcmp(key, "state") == 0)
+            snprintf(conf->state, sizeof(conf->state), "%s", args);
+        else if (strcmp(key, "collector") == 0)
+            ret = conf_parse_collector(conf, args);
+        else if (strcmp(key, "collect") == 0)
+            conf->collect = atoi(args);
+        else if (strcmp(key, "outlier") == 0)
+            conf->outlier = atof(args);
+        else if (strcmp(key, "listen") == 0)
+            conf->listen = atoi(args);
+        else if (strcmp(key, "mru") == 0)
+            conf->mru = atoi(args);
+        else if (strcmp(key, "control") == 0)
+            snprintf(conf->control, sizeof(conf->control), "%s", args);
+        else if (strcmp(key, "vsock") == 0)
+            conf->vsock = atoi(args);
+        else if (strcmp(key, "shm") == 0)
+            snprintf(conf->shm, sizeof(conf->shm), "%s", args);
+        else if (strcmp(key, "leader") == 0)
+            snprintf(conf->leader, sizeof(conf->leader), "%s", args);
+        else if (strcmp(key, "handoff") == 0)
+            snprintf(conf->handoff, sizeof(conf->handoff), "%s", args);
+        else if (strcmp(key, "smear") == 0)
+            ret = smear_init(&conf->smear, args);
+        else if (strcmp(key, "burst") == 0)
+            srv.burst = atoi(args);
+        else if (strcmp(key, "interval") == 0)
+            srv.interval = atoi(args);
+        else
+            ret = -1;
+
+        if (ret != 0)
+            fprintf(stderr, "%s:%d: invalid line \n", path, lineno);
+    }
+
+    if (ret == 0 && (conf->poll < 0 || conf->poll > POLL_MAX || conf->timeout < 1))
+    {
+        fprintf(stderr, "%s: poll or timeout out of range \n", path);
+        ret = -1;
+    }
+    if (ret == 0 && conf->nservers == 0 && conf->listen == 0 && conf->vsock == 0
+        && conf->collect == 0)
+    {
+        fprintf(stderr, "%s: no servers \n", path);
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Rebuild the peer table for a new configuration.  Peers whose address
+ * and port are unchanged keep their socket, last sample and poll timer,
+ * new ones get a fresh socket and removed ones are closed.  A new peer
+ * whose socket cannot be opened yet stays in the table without one, and
+ * every query tries again.
+ */
+void peers_sync(struct ntp_peer *peers, int *npeers, const struct ntp_conf *conf)
+{
+    struct ntp_peer old[CONF_MAX_SERVERS], *peer;
+    const struct ntp_server_conf *srv;
+    int nold = *npeers;
+    int i, j;
+
+    memcpy(old, peers, sizeof(old));
+    *npeers = 0;
+
+    for (i = 0; i < conf->nservers; i++)
+    {
+        srv = &conf->servers[i];
+        peer = &peers[(*npeers)++];
+
+        for (j = 0; j < nold; j++)
+            if (old[j].sockfd >= 0 && old[j].addr.sin_addr.s_addr == srv->addr
+                && old[j].addr.sin_port == htons(srv->port) && old[j].stream == srv->vsock
+                && old[j].ptp == srv->ptp)
+                break;
+
+        if (j < nold)
+        {
+            *peer = old[j];
+            old[j].sockfd = -1;
+            old[j].gsockfd = -1;
+        }
+        else
+        {
+            memset(peer, 0, sizeof(*peer));
+            peer->addr.sin_family = AF_INET;
+            peer->addr.sin_port = htons(srv->port);
+            peer->addr.sin_addr.s_addr = srv->addr;
+            peer->next = now_ns(CLOCK_MONOTONIC);
+            peer->stream = srv->vsock;
+            peer->ptp = srv->ptp;
+
+            /*
+             * A vsock host that is not up yet, PTP ports still held by
+             * the instance handing over or a network that is not there
+             * yet are retried by every query.
+             */
+            if (peer_connect(peer) != 0)
+            {
+                perror(peer->ptp ? "ptp socket error" : peer->stream ? "vsock connect error" : "socket error");
+                peer_close(peer);
+            }
+        }
+
+        peer->conf = srv;
+        peer->state = srv->mesh ? NULL : state_lookup(srv->addr, srv->port);
+        /* without SO_TXTIME support fall back to pacing in user space */
+        if ((peer->txtime = srv->txtime) && peer->sockfd >= 0 && enable_txtime(peer->sockfd) != 0)
+        {
+            perror("SO_TXTIME unavailable, pacing with clock_nanosleep");
+            peer->txtime = 0;
+        }
+    }
+
+    for (j = 0; j < nold; j++)
+        peer_close(&old[j]);
+}
+
+/* start the peers that are due, returns how many were started */
+int peers_start(struct ntp_peer *peers, int npeers, const struct ntp_conf *conf, int64_t now)
+{
+    static unsigned int cursor;
+    struct ntp_peer *peer;
+    int64_t period = poll_ns(conf->poll), real = now_ns(CLOCK_REALTIME);
+    int i, n = 0, due = 0, probe, poll;
+
+    for (i = 0; i < npeers; i++)
+    {
+        if (peers[i].conf->mesh)
+        {
+            due |= peers[i].next <= now;
+            continue;
+        }
+        if (peers[i].query.active || peers[i].next > now)
+            continue;
+        poll = peers[i].conf->poll == POLL_GLOBAL ? conf->poll : peers[i].conf->poll;
+        peers[i].period = poll_ns(poll);
+        peers[i].next = now + peers[i].period;
+        if (peers[i].state)
+        {
+            if (!state_due(peers[i].state, poll, real))
+                continue;
+            peers[i].state->seen = real;
+        }
+        query_start(&peers[i], now);
+        n++;
+    }
+    if (!due)
+        return n;
+
+    /*
+     * Mesh peers take turns, meshprobe of them per poll interval, so a
+     * round across N instances costs O(N) exchanges rather than O(N^2).
+     */
+    for (i = 0, probe = conf->meshprobe; i < npeers && probe > 0; i++)
+    {
+        peer = &peers[cursor++ % npeers];
+        if (!peer->conf->mesh)
+            continue;
+        if (!peer->query.active)
+        {
+            query_start(peer, now);
+            n++;
+        }
+        probe--;
+    }
+    for (i = 0; i < npeers; i++)
+        if (peers[i].conf->mesh)
+        {
+            peers[i].period = period;
+            peers[i].next = now + period;
+        }
+    return n;
+}
+
+/*
+ * Compare this host with its mesh: the median offset to the peers
+ * estimates how far off the local clock is, the median absolute
+ * deviation how consistent they are.  Peers beyond the outlier
+ * threshold from the median are the likely bad clocks.
+ */
+void mesh_report(const struct ntp_peer *peers, int npeers, const struct ntp_conf *conf)
+{
+    double v[CONF_MAX_SERVERS], m, mad, outlier;
+    int i, n = 0, fresh = 0;
+
+    for (i = 0; i < npeers; i++)
+    {
+        if (!peers[i].conf->mesh || peers[i].sample.t4 == 0)
+            continue;
+        fresh |= peers[i].valid;
+        v[n++] = peers[i].sample.offset;
+    }
+    if (!fresh || quiet)
+        return;
+
+    m = median(v, n);
+    for (i = 0; i < n; i++)
+        v[i] = fabs(v[i] - m);
+    mad = median(v, n);
+    outlier = conf->outlier ? conf->outlier : COLLECT_OUTLIER;
+
+    printf("mesh peers %d self %lf spread %lf%s \n", n, -m, mad, fabs(m) > outlier ? " OUTLIER" : "");
+    for (i = 0; i < npeers; i++)
+        if (peers[i].conf->mesh && peers[i].sample.t4 && fabs(peers[i].sample.offset - m) > outlier)
+            printf("mesh suspect %s offset %lf \n", peers[i].conf->host, peers[i].sample.offset);
+}
+
+/* the lowest delay among the fresh samples, or NULL */
+struct ntp_peer *peers_select(struct ntp_peer *peers, int npeers)
+{
+    struct ntp_peer *best = NULL;
+    int i;
+
+    for (i = 0; i < npeers; i++)
+        if (peers[i].valid && !peers[i].conf->mesh && !peers[i].falseticker && (best == NULL || peers[i].sample.delay < best->sample.delay))
+            best = &peers[i];
+    return best;
+}
+
+static struct ntp_shm *shmpage;
+
+/* the correction page read by ntpshim, world readable and never truncated */
+int shm_page_open(const char *path)
+{
+    struct ntp_shm *shm;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, sysconf(_SC_PAGESIZE)) != 0
+        || (shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    shm->magic = NTP_SHM_MAGIC;
+    shmpage = shm;
+    return 0;
+}
+
+/*
+ * The leader page.  Instances sharing it elect one leader through a
+ * robust process-shared mutex the leader holds for as long as it runs;
+ * only the leader queries and sets the clock.  Followers serve what it
+ * publishes, and when it dies the kernel marks the mutex owner-dead so
+ * the next follower to try the lock takes over.
+ */
+struct ntp_leader {
+    char                magic[8];
+    pthread_mutex_t     lock;
+    _Atomic uint32_t    seq;        /* seqlock over pid and sync */
+    pid_t               pid;
+    struct ntp_sync     sync;
+};
+
+static struct ntp_leader *leaderpage;
+static int leading;
+
+int leader_open(const char *path)
+{
+    struct ntp_leader *l;
+    pthread_mutexattr_t attr;
+    int fd, ret = 0;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(*l)) != 0 || flock(fd, LOCK_EX) != 0
+        || (l = mmap(NULL, sizeof(*l), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* the first instance sets the mutex up, the others wait on the flock */
+    if (memcmp(l->magic, LEADER_MAGIC, 8) != 0)
+    {
+        memset(l, 0, sizeof(*l));
+        if (pthread_mutexattr_init(&attr) != 0
+            || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0
+            || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0
+            || pthread_mutex_init(&l->lock, &attr) != 0)
+            ret = -1;
+        else
+            memcpy(l->magic, LEADER_MAGIC, 8);
+    }
+    /* the mapping keeps the file open, so the flock has to go explicitly */
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (ret != 0)
+        return -1;
+
+    leaderpage = l;
+    return 0;
+}
+
+/* 1 if this instance leads, taking over from a dead leader if need be */
+int leader_try(void)
+{
+    int ret;
+
+    if (leading)
+        return 1;
+    if ((ret = pthread_mutex_trylock(&leaderpage->lock)) == EOWNERDEAD)
+        ret = pthread_mutex_consistent(&leaderpage->lock);
+    if (ret != 0)
+        return 0;
+    leading = 1;
+    return 1;
+}
+
+void leader_release(void)
+{
+    if (leading)
+        pthread_mutex_unlock(&leaderpage->lock);
+    leading = 0;
+}
+
+void leader_publish(const struct ntp_sync *sync)
+{
+    uint32_t seq = atomic_load_explicit(&leaderpage->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&leaderpage->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    leaderpage->pid = getpid();
+    leaderpage->sync = *sync;
+    atomic_store_explicit(&leaderpage->seq, seq + 2, memory_order_release);
+}
+
+/* the leader's state and pid, 0 while it has published nothing yet */
+pid_t leader_read(struct ntp_sync *sync)
+{
+    struct ntp_sync copy;
+    uint32_t seq;
+    pid_t pid;
+
+    do
+    {
+        seq = atomic_load_explicit(&leaderpage->seq, memory_order_acquire);
+        pid = leaderpage->pid;
+        copy = leaderpage->sync;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&leaderpage->seq, memory_order_relaxed));
+
+    if (seq == 0)
+        return 0;
+    *sync = copy;
+    return pid;
+}
+
+static int resident;                /* set before the compute thread starts */
+static int leapset;
+static time_t leapcleared;
+
+/*
+ * Have the kernel insert the leap second the smear relies on: armed with
+ * STA_INS within a day of the configured leap, or on the last day of a
+ * month the selected server announces one for (LI 1).  A step cancels an
+ * armed leap, and the kernel only takes STA_INS up again once it has
+ * been clear across a second, so a step (an offset beyond SLEW_MAX)
+ * clears STA_INS to arm it again a round at least two seconds later.
+ */
+void leap_arm(const struct ntp_conf *conf, const struct ntp_sample *s, int stepped)
+{
+    struct timex tx;
+    struct tm tm;
+    time_t now = time(NULL), tomorrow = now + 86400;
+    int want;
+
+    gmtime_r(&tomorrow, &tm);
+    want = (conf->smear.window && now < conf->smear.leap && conf->smear.leap - now <= 86400)
+           || (s->li == 1 && tm.tm_mday == 1);
+
+    memset(&tx, 0, sizeof(tx));
+    if (adjtimex(&tx) < 0)
+        return;
+    if (want && !(tx.status & STA_INS) && now > leapcleared + 1)
+        tx.status |= STA_INS;
+    else if ((tx.status & STA_INS) && (want ? stepped : leapset))
+    {
+        tx.status &= ~STA_INS;
+        leapcleared = now;
+    }
+    else
+        return;
+
+    tx.modes = ADJ_STATUS;
+    if (adjtimex(&tx) < 0)
+    {
+        perror("leap second error");
+        return;
+    }
+    leapset = (tx.status & STA_INS) != 0;
+    if (leapset)
+        printf("leap second armed \n");
+}
+
+int apply_sample(const struct ntp_peer *peer, const struct ntp_conf *conf, int query)
+{
+    int slew = resident && fabs(peer->sample.offset) < SLEW_MAX, poll;
+
+    if (!quiet)
+        printf("Server: %s\n", peer->conf->host);
+    if (conf->panic > 0 && fabs(peer->sample.offset) > conf->panic)
+    {
+        fprintf(stderr, "offset %lf exceeds panic threshold \n", peer->sample.offset);
+        return -1;
+    }
+
+    if ((query || shmpage) && !quiet)
+        printf("offset %lf delay %lf \n", peer->sample.offset, peer->sample.delay);
+    if (query)
+        return 0;
+    if (shmpage)
+    {
+        poll = peer->conf->poll == POLL_GLOBAL ? conf->poll : peer->conf->poll;
+        ntp_shm_store(shmpage, (int64_t) (peer->sample.offset * 1e9), peer->sample.t4,
+                      peer->sample.t4 + SHM_POLLS * poll_ns(poll + (statefile ? STATE_BACKOFF : 0)));
+    }
+    else if (apply_offset(peer->sample.offset, slew) != 0)
+    {
+        perror(slew ? "adjtime error" : "settimeofday error");
+        return -1;
+    }
+    else if (resident)
+        leap_arm(conf, &peer->sample, !slew);
+    return 0;
+}
+
+/*
+ * Compute side: its own copy of every peer that has reported, found by
+ * address, so the I/O loop can reshuffle its table on a reload at any
+ * time.  In one-shot runs main() drains the events itself.
+ */
+static struct ntp_peer cpeers[CONF_MAX_SERVERS];
+static struct ntp_server_conf cconfs[CONF_MAX_SERVERS];
+static int ncpeers;
+
+struct ntp_peer *compute_peer(const struct ntp_event *ev)
+{
+    int i;
+
+    for (i = 0; i < ncpeers; i++)
+        if (cpeers[i].addr.sin_addr.s_addr == ev->addr.sin_addr.s_addr
+            && cpeers[i].addr.sin_port == ev->addr.sin_port && cconfs[i].vsock == ev->vsock
+            && cconfs[i].ptp == ev->ptp)
+            break;
+    if (i == ncpeers)
+    {
+        if (ncpeers == CONF_MAX_SERVERS)
+            return NULL;
+        memset(&cpeers[ncpeers++], 0, sizeof(cpeers[0]));
+        cpeers[i].sockfd = -1;
+    }
+    snprintf(cconfs[i].host, sizeof(cconfs[i].host), "%s", ev->host);
+    cconfs[i].vsock = ev->vsock;
+    cconfs[i].ptp = ev->ptp;
+    cconfs[i].mesh = ev->mesh;
+    cconfs[i].poll = ev->poll;
+    cpeers[i].conf = &cconfs[i];
+    cpeers[i].addr = ev->addr;
+    return &cpeers[i];
+}
+
+void command_push(const struct ntp_sync *sync)
+{
+    int i;
+
+    if (cmdfd < 0 || (i = spsc_reserve(&cmdring, COMMAND_RING)) < 0)
+        return;
+    commands[i] = *sync;
+    spsc_commit(&cmdring);
+    eventfd_write(cmdfd, 1);
+}
+
+/* the end of a round: report, select and apply, 0 if a sample was applied */
+int compute_round(const struct ntp_conf *conf, int query)
+{
+    static uint32_t dropped;
+    static int64_t reported;
+    struct ntp_peer *best;
+    struct ntp_sync sync;
+    int64_t now = now_ns(CLOCK_MONOTONIC);
+    uint32_t n;
+    int i, ret = -1;
+
+    /* fast peers run many rounds a second, their output is thinned out */
+    if (!(quiet = resident && reported && now - reported < REPORT_INTERVAL))
+        reported = now;
+    if ((n = atomic_load_explicit(&evdropped, memory_order_relaxed)) != dropped)
+        printf("events dropped %u \n", dropped = n);
+    consensus_expire(conf, now);
+    consensus_report();
+    if ((best = peers_select(cpeers, ncpeers)) != NULL && (ret = apply_sample(best, conf, query)) == 0
+        && !query)
+    {
+        sync.stratum = best->sample.stratum + 1;
+        sync.refid = best->addr.sin_addr.s_addr;
+        sync.reftime = now_ns(CLOCK_REALTIME) / 1000;
+        /* the whole path to the reference, and what the server and its clock add to the error */
+        sync.delay = best->sample.rootdelay + (best->sample.delay > 0 ? best->sample.delay : 0);
+        sync.disp = best->sample.rootdisp + ldexp(1, best->sample.precision);
+        command_push(&sync);
+        if (!shmpage)
+            consensus_shift(best->sample.offset);
+    }
+    mesh_report(cpeers, ncpeers, conf);
+    /* a sample is applied once, its vote stays */
+    for (i = 0; i < ncpeers; i++)
+        cpeers[i].valid = 0;
+    record_flush();
+    return ret;
+}
+
+/* handle the queued events; the result of the last round, or -2 once told to stop */
+int compute_drain(const struct ntp_conf *conf, int query)
+{
+    struct ntp_event *ev;
+    struct ntp_peer *peer;
+    int i, type, ret = -1;
+
+    while ((i = spsc_peek(&evring, EVENT_RING)) >= 0)
+    {
+        ev = &events[i];
+        switch (type = ev->type) {
+        case EV_SAMPLE:
+            if ((peer = compute_peer(ev)) != NULL)
+                record_add(peer, &ev->sample);
+            break;
+        case EV_RESULT:
+            if ((peer = compute_peer(ev)) != NULL)
+            {
+                peer->sample = ev->sample;
+                peer->valid = 1;
+                consensus_add(peer);
+            }
+            break;
+        case EV_ROUND:
+            ret = compute_round(conf, query);
+            break;
+        case EV_RESET:
+            ncpeers = 0;
+            consensus_reset(cpeers, 0);
+            break;
+        }
+        spsc_release(&evring);
+        if (type == EV_STOP)
+            return -2;
+    }
+    telemetry_flush();
+    return ret;
+}
+
+/*
+ * Most recently used clients, MRU_WAYS-way set associative, evicting the
+ * entry seen longest ago.  Entries are updated with relaxed atomics by
+ * every serving thread and read the same way by the dump, so neither
+ * side waits; a racing update may lose a count, which is acceptable for
+ * statistics that are sampled anyway.
+ */
+struct ntp_client {
+    _Atomic uint32_t    addr;           /* 0 marks a free entry */
+    _Atomic uint32_t    count;
+    _Atomic int64_t     first;          /* usec */
+    _Atomic int64_t     last;
+    _Atomic int64_t     interval;       /* moving average of the inter-arrival time, usec,
+                                           seeded with the first gap */
+    _Atomic uint8_t     mode;
+    _Atomic uint8_t     version;
+};
+
+static struct ntp_client clients[MRU_SIZE];
+
+void mru_update(uint32_t addr, int mode, int version, int64_t now, uint32_t weight)
+{
+    struct ntp_client *set, *c, *victim = NULL;
+    int64_t last, oldest = INT64_MAX, iv, gap;
+    uint32_t h;
+    int i;
+
+    h = ntohl(addr) * 2654435761u;
+    set = &clients[((uint64_t) h * MRU_SIZE >> 32) & ~(MRU_WAYS - 1)];
+
+    for (i = 0; i < MRU_WAYS; i++)
+    {
+        c = &set[i];
+        if (atomic_load_explicit(&c->addr, memory_order_relaxed) == addr)
+        {
+            /* 1 in weight requests is sampled, so the gap spans about weight of them */
+            last = atomic_exchange_explicit(&c->last, now, memory_order_relaxed);
+            gap = (now - last) / weight;
+            iv = atomic_load_explicit(&c->interval, memory_order_relaxed);
+            if (atomic_fetch_add_explicit(&c->count, weight, memory_order_relaxed) == weight)
+                iv = gap;
+            atomic_store_explicit(&c->interval, iv + (gap - iv) / 8, memory_order_relaxed);
+            atomic_store_explicit(&c->mode, mode, memory_order_relaxed);
+            atomic_store_explicit(&c->version, version, memory_order_relaxed);
+            return;
+        }
+        if ((last = atomic_load_explicit(&c->last, memory_order_relaxed)) < oldest)
+        {
+            oldest = last;
+            victim = c;
+        }
+    }
+
+    atomic_store_explicit(&victim->addr, addr, memory_order_relaxed);
+    atomic_store_explicit(&victim->count, weight, memory_order_relaxed);
+    atomic_store_explicit(&victim->first, now, memory_order_relaxed);
+    atomic_store_explicit(&victim->last, now, memory_order_relaxed);
+    atomic_store_explicit(&victim->interval, 0, memory_order_relaxed);
+    atomic_store_explicit(&victim->mode, mode, memory_order_relaxed);
+    atomic_store_explicit(&victim->version, version, memory_order_relaxed);
+}
+
+struct ntp_client_row {
+    uint32_t    addr;
+    uint32_t    count;
+    int64_t     first;
+    int64_t     last;
+    int64_t     interval;
+    int         mode;
+    int         version;
+};
+
+/* shell sort by descending count, in place where qsort may allocate */
+void mru_sort(struct ntp_client_row *rows, int n)
+{
+    struct ntp_client_row row;
+    int gap, i, j;
+
+    for (gap = n / 2; gap > 0; gap /= 2)
+        for (i = gap; i < n; i++)
+        {
+            row = rows[i];
+            for (j = i; j >= gap && rows[j - gap].count < row.count; j -= gap)
+                rows[j] = rows[j - gap];
+            rows[j] = row;
+        }
+}
+
+/* format the client table, heaviest first, into buf */
+size_t mru_dump(char *buf, size_t size)
+{
+    static struct ntp_client_row rows[MRU_SIZE];
+    char host[INET_ADDRSTRLEN];
+    int64_t now = now_ns(CLOCK_REALTIME) / 1000;
+    size_t len = 0;
+    int i, n = 0;
+
+    for (i = 0; i < MRU_SIZE; i++)
+    {
+        if ((rows[n].addr = atomic_load_explicit(&clients[i].addr, memory_order_relaxed)) == 0)
+            continue;
+        rows[n].count = atomic_load_explicit(&clients[i].count, memory_order_relaxed);
+        rows[n].first = atomic_load_explicit(&clients[i].first, memory_order_relaxed);
+        rows[n].last = atomic_load_explicit(&clients[i].last, memory_order_relaxed);
+        rows[n].interval = atomic_load_explicit(&clients[i].interval, memory_order_relaxed);
+        rows[n].mode = atomic_load_explicit(&clients[i].mode, memory_order_relaxed);
+        rows[n].version = atomic_load_explicit(&clients[i].version, memory_order_relaxed);
+        n++;
+    }
+    mru_sort(rows, n);
+
+    len += snprintf(buf + len, size - len, "address\tcount\tmode\tversion\tfirst\tlast\tinterval \n");
+    for (i = 0; i < n && len < size; i++)
+    {
+        inet_ntop(AF_INET, &rows[i].addr, host, sizeof(host));
+        len += snprintf(buf + len, size - len, "%s\t%u\t%d\t%d\t%.0lf\t%.0lf\t%.3lf \n",
+                        host, rows[i].count, rows[i].mode, rows[i].version,
+                        (now - rows[i].first) / 1000000.0, (now - rows[i].last) / 1000000.0,
+                        rows[i].interval / 1000000.0);
+    }
+    return len < size ? len : size;
+}
+
+/*
+ * Cost accounting for "perf": a group of per-thread counters (cycles,
+ * instructions, cache misses, user space only) on the I/O thread, sampled
+ * around every batch of served packets and every drain of a peer's
+ * replies.  On x86_64 a sample is one rdpmc per counter through its
+ * mapped page; elsewhere, or when the kernel does not allow user rdpmc,
+ * it is a read() of the group.  The control socket reports the totals as
+ * cycles per packet and IPC.
+ */
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_MISSES, PERF_COUNTERS };
+enum { PERF_SERVE, PERF_QUERY, PERF_PATHS };
+
+struct ntp_perf_path {
+    _Atomic uint64_t    batches;
+    _Atomic uint64_t    packets;
+    _Atomic uint64_t    count[PERF_COUNTERS];
+};
+
+static struct ntp_perf_path perfpaths[PERF_PATHS];
+static struct perf_event_mmap_page *perfpage[PERF_COUNTERS];
+static int perffd[PERF_COUNTERS], perfon;
+
+int perf_open(void)
+{
+    static const uint64_t config[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    struct perf_event_attr attr;
+    void *page;
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        if ((perffd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? perffd[0] : -1, PERF_FLAG_FD_CLOEXEC)) < 0)
+            return -1;
+        page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, perffd[i], 0);
+        perfpage[i] = page == MAP_FAILED ? NULL : page;
+    }
+    if (ioctl(perffd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0)
+        return -1;
+    perfon = 1;
+    return 0;
+}
+
+#if defined(__x86_64__)
+static inline uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t lo, hi;
+
+    __asm__ volatile ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+    return (uint64_t) hi << 32 | lo;
+}
+#endif
+
+/* one counter read in user space through its page, -1 if that is not allowed */
+int perf_rdpmc(const struct perf_event_mmap_page *pc, uint64_t *value)
+{
+#if defined(__x86_64__)
+    uint32_t seq, idx, shift;
+    uint64_t count;
+
+    do
+    {
+        seq = pc->lock;
+        atomic_signal_fence(memory_order_acquire);
+        idx = pc->index;
+        if (!pc->cap_user_rdpmc || idx == 0)
+            return -1;
+        shift = 64 - pc->pmc_width;
+        count = pc->offset + ((int64_t) (rdpmc(idx - 1) << shift) >> shift);
+        atomic_signal_fence(memory_order_acquire);
+    } while (pc->lock != seq);
+    *value = count;
+    return 0;
+#else
+    (void) pc;
+    (void) value;
+    return -1;
+#endif
+}
+
+void perf_sample(uint64_t *v)
+{
+    uint64_t group[1 + PERF_COUNTERS];
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++)
+        if (perfpage[i] == NULL || perf_rdpmc(perfpage[i], &v[i]) != 0)
+            break;
+    if (i == PERF_COUNTERS)
+        return;
+
+    if (read(perffd[0], group, sizeof(group)) == sizeof(group))
+        memcpy(v, group + 1, sizeof(uint64_t) * PERF_COUNTERS);
+    else
+        memset(v, 0, sizeof(uint64_t) * PERF_COUNTERS);
+}
+
+void perf_begin(uint64_t *v)
+{
+    if (perfon)
+        perf_sample(v);
+}
+
+/* charge the batch begun at v to path, batches that found nothing are free */
+void perf_end(int path, const uint64_t *v, int packets)
+{
+    struct ntp_perf_path *p = &perfpaths[path];
+    uint64_t now[PERF_COUNTERS];
+    int i;
+
+    if (!perfon || packets <= 0)
+        return;
+    perf_sample(now);
+    for (i = 0; i < PERF_COUNTERS; i++)
+        atomic_fetch_add_explicit(&p->count[i], now[i] - v[i], memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->packets, packets, memory_order_relaxed);
+}
+
+size_t perf_dump(char *buf, size_t size)
+{
+    static const char *name[PERF_PATHS] = { "serve", "query" };
+    uint64_t packets, count[PERF_COUNTERS];
+    size_t len = 0;
+    int i, j;
+
+    if (!perfon || size == 0)
+        return 0;
+
+    len += snprintf(buf + len, size - len, "path\tbatches\tpackets\tcycles/packet\tipc\tmisses/packet \n");
+    for (i = 0; i < PERF_PATHS && len < size; i++)
+    {
+        packets = atomic_load_explicit(&perfpaths[i].packets, memory_order_relaxed);
+        for (j = 0; j < PERF_COUNTERS; j++)
+            count[j] = atomic_load_explicit(&perfpaths[i].count[j], memory_order_relaxed);
+        len += snprintf(buf + len, size - len, "%s\t%llu\t%llu\t%.0lf\t%.2lf\t%.3lf \n", name[i],
+                        (unsigned long long) atomic_load_explicit(&perfpaths[i].batches, memory_order_relaxed),
+                        (unsigned long long) packets,
+                        packets ? (double) count[PERF_CYCLES] / packets : 0,
+                        count[PERF_CYCLES] ? (double) count[PERF_INSTRUCTIONS] / count[PERF_CYCLES] : 0,
+                        packets ? (double) count[PERF_MISSES] / packets : 0);
+    }
+    return len < size ? len : size;
+}
+
+int unix_listen(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* every connection to the control socket gets the current tables and is closed */
+void *control_thread(void *arg)
+{
+    static char buf[CTL_BUFSIZE];
+    int fd = (int) (intptr_t) arg, conn;
+    size_t len;
+
+    for (;;)
+    {
+        if ((conn = accept(fd, NULL, NULL)) < 0)
+            continue;
+        len = mru_dump(buf, sizeof(buf));
+        len += perf_dump(buf + len, sizeof(buf) - len);
+        len += snprintf(buf + len, sizeof(buf) - len, "events dropped %u \n",
+                        atomic_load_explicit(&evdropped, memory_order_relaxed));
+        if (len >= sizeof(buf))
+            len = sizeof(buf) - 1;
+        send(conn, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(conn);
+    }
+    return NULL;
+}
+
+int serve_open(int port)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || enable_rx_timestamps(fd) != 0
+        || setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* turn a client request received at recvts (usec) into the reply */
+void serve_reply(struct ntphdr *ntp, int vn, int64_t recvts, const struct ntp_conf *conf,
+                 const struct ntp_sync *sync)
+{
+    struct timeval tv;
+    int64_t transts, reftime, corr = 0;
+    int synced = 1;
+
+    /* with "shm" the clock is left alone: serve it corrected, or as unsynchronised once that is stale */
+    if (shmpage)
+    {
+        synced = ntp_shm_read(shmpage, recvts * 1000, &corr) == 0;
+        corr = synced ? corr / 1000 : 0;
+    }
+    reftime = sync->reftime + corr;
+    recvts += corr;
+
+    ntp->ntp_orits = ntp->ntp_transts;
+    /* a smeared leap is never announced, clients must not step */
+    ntp_set_lvm(ntp, 0, vn, MODE_SERVER);
+    ntp->ntp_stratum = synced ? sync->stratum : NTP_LOCAL_STRATUM;
+    ntp->ntp_precision = NTP_PRECISION;
+    ntp->ntp_rtdelay = ntp_short_from_double(synced ? sync->delay : 0);
+    ntp->ntp_rtdispersion = ntp_short_from_double(synced ? sync->disp : 0);
+    if (synced)
+        ntp->ntp_refid = sync->refid;
+    else
+        memcpy(&ntp->ntp_refid, "LOCL", 4);
+    ntp->ntp_refts = ntp_ts_from_usec(reftime + smear_offset(&conf->smear, reftime));
+    ntp->ntp_recvts = ntp_ts_from_usec(recvts + smear_offset(&conf->smear, recvts));
+
+    gettimeofday(&tv, NULL);
+    transts = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec + corr;
+    ntp->ntp_transts = ntp_ts_from_usec(transts + smear_offset(&conf->smear, transts));
+}
+
+/*
+ * Answer every client request queued on fd, SERVE_BATCH at a time with
+ * one recvmmsg() and one sendmmsg().  The socket is bound to INADDR_ANY,
+ * so each reply names the local address its request came in on
+ * (IP_PKTINFO) and leaves a multi-homed host from that address rather
+ * than whichever the route picks.  Returns how many packets were read.
+ */
+union ntp_serve_cmsg {
+    char            buf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct cmsghdr  align;
+};
+
+int serve_packets(int fd, const struct ntp_conf *conf, const struct ntp_sync *sync)
+{
+    static char bufs[SERVE_BATCH][BUFSIZE];
+    static struct sockaddr_in addrs[SERVE_BATCH];
+    static union ntp_serve_cmsg rx[SERVE_BATCH], tx[SERVE_BATCH];
+    static struct iovec iov[SERVE_BATCH];
+    static struct mmsghdr in[SERVE_BATCH], out[SERVE_BATCH];
+    static _Thread_local unsigned int tick;
+    struct in_pktinfo pktinfo;
+    struct ntphdr *ntp;
+    struct cmsghdr *c;
+    struct timespec ts;
+    int64_t recvts;
+    int i, n, m, vn, local, total = 0;
+
+    do
+    {
+        for (i = 0; i < SERVE_BATCH; i++)
+        {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = BUFSIZE;
+            memset(&in[i].msg_hdr, 0, sizeof(in[i].msg_hdr));
+            in[i].msg_hdr.msg_name = &addrs[i];
+            in[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            in[i].msg_hdr.msg_iov = &iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+            in[i].msg_hdr.msg_control = rx[i].buf;
+            in[i].msg_hdr.msg_controllen = sizeof(rx[i].buf);
+        }
+        if ((n = recvmmsg(fd, in, SERVE_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+            break;
+        total += n;
+
+        for (i = 0, m = 0; i < n; i++)
+        {
+            recvts = 0;
+            local = 0;
+            for (c = CMSG_FIRSTHDR(&in[i].msg_hdr); c != NULL; c = CMSG_NXTHDR(&in[i].msg_hdr, c))
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+                {
+                    memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                    recvts = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+                }
+                else if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO)
+                {
+                    memcpy(&pktinfo, CMSG_DATA(c), sizeof(pktinfo));
+                    local = 1;
+                }
+            recvts = (recvts ? recvts : now_ns(CLOCK_REALTIME)) / 1000;
+
+            if (in[i].msg_len < 1)
+                continue;
+            ntp = (struct ntphdr *) bufs[i];
+            vn = ntp_vn(ntp);
+            if (conf->mru && ++tick % conf->mru == 0)
+                mru_update(addrs[i].sin_addr.s_addr, ntp_mode(ntp), vn, recvts, conf->mru);
+            if ((ntp = ntp_view(bufs[i], in[i].msg_len)) == NULL || ntp_mode(ntp) != MODE_CLIENT
+                || vn < 1 || vn > VERSION_4)
+                continue;
+
+            serve_reply(ntp, vn, recvts, conf, sync);
+
+            iov[i].iov_len = NTP_HLEN;
+            memset(&out[m].msg_hdr, 0, sizeof(out[m].msg_hdr));
+            out[m].msg_hdr.msg_name = &addrs[i];
+            out[m].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            out[m].msg_hdr.msg_iov = &iov[i];
+            out[m].msg_hdr.msg_iovlen = 1;
+            /* ipi_spec_dst is the local address the request was for */
+            if (local)
+            {
+                memset(&tx[m], 0, sizeof(tx[m]));
+                out[m].msg_hdr.msg_control = tx[m].buf;
+                out[m].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(pktinfo));
+                c = CMSG_FIRSTHDR(&out[m].msg_hdr);
+                c->cmsg_level = IPPROTO_IP;
+                c->cmsg_type = IP_PKTINFO;
+                c->cmsg_len = CMSG_LEN(sizeof(pktinfo));
+                pktinfo.ipi_ifindex = 0;
+                pktinfo.ipi_addr.s_addr = 0;
+                memcpy(CMSG_DATA(c), &pktinfo, sizeof(pktinfo));
+            }
+            m++;
+        }
+        if (m && sendmmsg(fd, out, m, 0) < 0)
+            perror("send error");
+    } while (n == SERVE_BATCH);
+
+    return total;
+}
+
+/*
+ * vsock server for guests: a stream per guest carrying 48 byte headers
+ * back to back, each answered in place.  Connections sit in a fixed
+ * table polled by the main loop; a guest that does not read its replies
+ * is dropped rather than buffered for.
+ */
+struct ntp_vconn {
+    int         fd;
+    size_t      len;
+    char        buf[NTP_HLEN];
+};
+
+static struct ntp_vconn vconns[VSOCK_CONNS];
+
+int vsock_open(int port)
+{
+    struct sockaddr_vm vm;
+    int fd;
+
+    memset(&vm, 0, sizeof(vm));
+    vm.svm_family = AF_VSOCK;
+    vm.svm_cid = VMADDR_CID_ANY;
+    vm.svm_port = port;
+
+    if ((fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &vm, sizeof(vm)) != 0 || listen(fd, VSOCK_CONNS) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void vsock_close(int fd)
+{
+    int i;
+
+    if (fd < 0)
+        return;
+    for (i = 0; i < VSOCK_CONNS; i++)
+        if (vconns[i].fd >= 0)
+        {
+            close(vconns[i].fd);
+            vconns[i].fd = -1;
+        }
+    close(fd);
+}
+
+void vsock_accept(int fd)
+{
+    int conn, i;
+
+    while ((conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        for (i = 0; i < VSOCK_CONNS && vconns[i].fd >= 0; i++)
+            ;
+        if (i == VSOCK_CONNS)
+        {
+            close(conn);
+            continue;
+        }
+        vconns[i].fd = conn;
+        vconns[i].len = 0;
+    }
+}
+
+void vsock_serve(struct ntp_vconn *c, const struct ntp_conf *conf, const struct ntp_sync *sync)
+{
+    struct ntphdr *ntp = (struct ntphdr *) c->buf;
+    struct timeval tv;
+    ssize_t nbytes;
+    int vn;
+
+    while ((nbytes = recv(c->fd, c->buf + c->len, NTP_HLEN - c->len, 0)) > 0)
+    {
+        gettimeofday(&tv, NULL);
+        if ((c->len += nbytes) < NTP_HLEN)
+            continue;
+        c->len = 0;
+
+        vn = ntp_vn(ntp);
+        if (ntp_mode(ntp) != MODE_CLIENT || vn < 1 || vn > VERSION_4)
+            continue;
+        serve_reply(ntp, vn, (int64_t) tv.tv_sec * 1000000 + tv.tv_usec, conf, sync);
+        if (send(c->fd, c->buf, NTP_HLEN, MSG_DONTWAIT | MSG_NOSIGNAL) != NTP_HLEN)
+            break;
+    }
+
+    /* closed, failed, or not reading its replies */
+    if (nbytes >= 0 || errno != EAGAIN)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/*
+ * Collector: an open addressing table keyed by (sending host, server
+ * address), each entry keeping the last COLLECT_WINDOW offsets.  Server
+ * 0 is the host's own entry fed by every sample it sends.  A key that
+ * finds no free slot within COLLECT_PROBE takes over the stalest entry
+ * probed, so the table never needs deletions.  Only the collector's
+ * thread touches it.
+ */
+struct ntp_collect_entry {
+    char        host[32];
+    uint32_t    server;
+    uint32_t    count;
+    int64_t     last;           /* unix ns of the newest sample */
+    float       offset[COLLECT_WINDOW];
+    double      median;         /* filled in by the report */
+    double      skew;
+};
+
+/* the fd lives in the poll array, so an unused slot's buffer is never touched */
+struct ntp_collect_conn {
+    int64_t     last;           /* CLOCK_MONOTONIC ns of the last data */
+    size_t      len;
+    char        buf[sizeof(struct ntp_batch) + TELEMETRY_BATCH * sizeof(struct ntp_record)];
+};
+
+/* allocated when collect mode starts, so other builds and modes carry none of it */
+static struct ntp_collect_entry *collect_table;
+static int *collect_idx;
+static double *collect_v;
+static uint32_t collect_dropped, collect_rejected;
+
+struct ntp_collect_entry *collect_entry(const char *host, uint32_t server)
+{
+    struct ntp_collect_entry *e, *stale = NULL;
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 32 && host[i]; i++)
+        h = (h ^ (uint8_t) host[i]) * 16777619u;
+    h = (h ^ server) * 16777619u;
+
+    for (i = 0; i < COLLECT_PROBE; i++)
+    {
+        e = &collect_table[(h + i) & (COLLECT_SIZE - 1)];
+        if (e->count == 0 || (e->server == server && strncmp(e->host, host, 32) == 0))
+            break;
+        if (stale == NULL || e->last < stale->last)
+            stale = e;
+    }
+    if (i == COLLECT_PROBE)
+        e = stale;
+
+    if (e->count == 0 || e->server != server || strncmp(e->host, host, 32) != 0)
+    {
+        memset(e, 0, sizeof(*e));
+        memcpy(e->host, host, 32);
+        e->host[31] = '\0';
+        e->server = server;
+    }
+    return e;
+}
+
+void collect_add(const char *host, uint32_t server, const struct ntp_record *r)
+{
+    struct ntp_collect_entry *e = collect_entry(host, server);
+
+    e->offset[e->count++ % COLLECT_WINDOW] = r->offset;
+    e->last = r->t4;
+}
+
+/* take in one telemetry message, returns its length or 0 if incomplete */
+size_t collect_batch(const char *buf, size_t len)
+{
+    const struct ntp_batch *hdr = (const struct ntp_batch *) buf;
+    const struct ntp_record *rec = (const struct ntp_record *) (hdr + 1);
+    char host[32];
+    size_t size;
+    uint32_t i;
+
+    if (len < sizeof(*hdr))
+        return 0;
+    if (memcmp(hdr->magic, TELEMETRY_MAGIC, 8) != 0 || hdr->count > TELEMETRY_BATCH)
+        return (size_t) -1;
+    if (len < (size = sizeof(*hdr) + hdr->count * sizeof(*rec)))
+        return 0;
+
+    memcpy(host, hdr->host, 32);
+    host[31] = '\0';
+    for (i = 0; i < hdr->count; i++)
+    {
+        /* kiss-o'-death, unsynchronised and otherwise unusable replies carry no offset */
+        if (!rec[i].valid)
+            continue;
+        collect_add(host, rec[i].addr, &rec[i]);
+        collect_add(host, 0, &rec[i]);
+    }
+    return size;
+}
+
+/*
+ * A host's skew is the median over its servers of its median offset to
+ * each, a server's deviation the median over its hosts of what they
+ * see beyond their own skew.  Either beyond outlier is flagged.
+ */
+void collect_report(double outlier)
+{
+    static double w[COLLECT_WINDOW];
+    int *idx = collect_idx;
+    double *v = collect_v;
+    struct ntp_collect_entry *e, *h;
+    char addr[INET_ADDRSTRLEN];
+    int i, j, k, n = 0, m, gap, t;
+
+    for (i = 0; i < COLLECT_SIZE; i++)
+    {
+        if ((e = &collect_table[i])->count == 0)
+            continue;
+        m = e->count < COLLECT_WINDOW ? e->count : COLLECT_WINDOW;
+        for (j = 0; j < m; j++)
+            w[j] = e->offset[j];
+        e->median = median(w, m);
+        idx[n++] = i;
+    }
+
+    /* group by host, host entry first */
+    for (gap = n / 2; gap > 0; gap /= 2)
+        for (i = gap; i < n; i++)
+        {
+            t = idx[i];
+            for (j = i; j >= gap; j -= gap)
+            {
+                e = &collect_table[idx[j - gap]];
+                h = &collect_table[t];
+                k = strncmp(e->host, h->host, 32);
+                if (k < 0 || (k == 0 && e->server <= h->server))
+                    break;
+                idx[j] = idx[j - gap];
+            }
+            idx[j] = t;
+        }
+
+    for (i = 0; i < n; i = j)
+    {
+        h = &collect_table[idx[i]];
+        for (j = i + 1, m = 0; j < n && strncmp(collect_table[idx[j]].host, h->host, 32) == 0; j++)
+            if (collect_table[idx[j]].server)
+                v[m++] = collect_table[idx[j]].median;
+        h->skew = m ? median(v, m) : h->median;
+        for (k = i + 1; k < j; k++)
+            collect_table[idx[k]].skew = h->skew;
+
+        if (h->server != 0)
+            continue;
+        m = h->count < COLLECT_WINDOW ? h->count : COLLECT_WINDOW;
+        for (k = 0; k < m; k++)
+            w[k] = h->offset[k];
+        printf("host %s samples %u p10 %lf p50 %lf p90 %lf skew %lf%s \n", h->host, h->count,
+               select_kth(w, m, m / 10), select_kth(w, m, m / 2), select_kth(w, m, m * 9 / 10),
+               h->skew, fabs(h->skew) > outlier ? " OUTLIER" : "");
+    }
+
+    /* group by server */
+    for (gap = n / 2; gap > 0; gap /= 2)
+        for (i = gap; i < n; i++)
+        {
+            t = idx[i];
+            for (j = i; j >= gap && collect_table[idx[j - gap]].server > collect_table[t].server; j -= gap)
+                idx[j] = idx[j - gap];
+            idx[j] = t;
+        }
+
+    for (i = 0; i < n; i = j)
+    {
+        e = &collect_table[idx[i]];
+        for (j = i, m = 0; j < n && collect_table[idx[j]].server == e->server; j++)
+            v[m++] = collect_table[idx[j]].median - collect_table[idx[j]].skew;
+        if (e->server == 0)
+            continue;
+        inet_ntop(AF_INET, &e->server, addr, sizeof(addr));
+        v[0] = median(v, m);
+        printf("server %s hosts %d deviation %lf%s \n", addr, m, v[0],
+               fabs(v[0]) > outlier ? " OUTLIER" : "");
+    }
+    printf("dropped %u rejected %u \n", collect_dropped, collect_rejected);
+    fflush(stdout);
+}
+
+/*
+ * Close the TCP senders silent for COLLECT_IDLE, or only the longest
+ * silent one when oldest is set.  A sender finds the connection closed
+ * before its next message and reconnects.  Returns the slots freed.
+ */
+int collect_reap(struct pollfd *pfd, struct ntp_collect_conn *conns, int nconns, int64_t now, int oldest)
+{
+    int i, victim = -1, n = 0;
+
+    for (i = 0; i < nconns; i++)
+    {
+        if (pfd[i].fd < 0 || now - conns[i].last < (int64_t) COLLECT_IDLE * 1000000000)
+            continue;
+        if (oldest)
+        {
+            if (victim < 0 || conns[i].last < conns[victim].last)
+                victim = i;
+            continue;
+        }
+        close(pfd[i].fd);
+        pfd[i].fd = -1;
+        n++;
+    }
+    if (victim >= 0)
+    {
+        close(pfd[victim].fd);
+        pfd[victim].fd = -1;
+        n++;
+    }
+    return n;
+}
+
+/* receive telemetry over UDP and TCP on port, reporting every 2^poll seconds */
+int collect_run(const struct ntp_conf *conf)
+{
+    struct ntp_collect_conn *conns;
+    struct pollfd *pfd, *cpfd;
+    struct sockaddr_in addr;
+    char buf[BUFSIZE];
+    int64_t now, next, wait;
+    ssize_t n;
+    size_t used;
+    int udpfd, tcpfd, fd, i, nconns = 0, one = 1;
+
+    if ((collect_table = calloc(COLLECT_SIZE, sizeof(*collect_table))) == NULL
+        || (collect_idx = calloc(COLLECT_SIZE, sizeof(*collect_idx))) == NULL
+        || (collect_v = calloc(COLLECT_SIZE, sizeof(*collect_v))) == NULL
+        || (conns = calloc(COLLECT_CONNS, sizeof(*conns))) == NULL
+        || (pfd = calloc(2 + COLLECT_CONNS, sizeof(*pfd))) == NULL)
+        return -1;
+    cpfd = pfd + 2;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(conf->collect);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ((udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0
+        || bind(udpfd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || (tcpfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0
+        || setsockopt(tcpfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+        || bind(tcpfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(tcpfd, 1024) != 0)
+        return -1;
+
+    pfd[0].fd = udpfd;
+    pfd[1].fd = tcpfd;
+    for (i = 0; i < 2 + COLLECT_CONNS; i++)
+    {
+        pfd[i].fd = i < 2 ? pfd[i].fd : -1;
+        pfd[i].events = POLLIN;
+    }
+
+    next = now_ns(CLOCK_MONOTONIC) + poll_ns(conf->poll);
+    for (;;)
+    {
+        if ((wait = next - (now = now_ns(CLOCK_MONOTONIC))) <= 0)
+        {
+            collect_reap(cpfd, conns, nconns, now, 0);
+            collect_report(conf->outlier ? conf->outlier : COLLECT_OUTLIER);
+            next += poll_ns(conf->poll);
+            continue;
+        }
+        /* only the slots up to the highest one in use are polled */
+        while (nconns > 0 && cpfd[nconns - 1].fd < 0)
+            nconns--;
+        if (poll(pfd, 2 + nconns, wait / 1000000 + 1) <= 0)
+            continue;
+        now = now_ns(CLOCK_MONOTONIC);
+
+        if (pfd[0].revents)
+            while ((n = recv(udpfd, buf, sizeof(buf), 0)) > 0)
+                if (collect_batch(buf, n) != (size_t) n)
+                    collect_dropped++;
+
+        if (pfd[1].revents)
+            while ((fd = accept4(tcpfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            {
+                for (i = 0; i < COLLECT_CONNS && cpfd[i].fd >= 0; i++)
+                    ;
+                if (i == COLLECT_CONNS && collect_reap(cpfd, conns, nconns, now, 1))
+                    for (i = 0; cpfd[i].fd >= 0; i++)
+                        ;
+                if (i == COLLECT_CONNS)
+                {
+                    close(fd);
+                    collect_rejected++;
+                    continue;
+                }
+                cpfd[i].fd = fd;
+                cpfd[i].revents = 0;
+                conns[i].len = 0;
+                conns[i].last = now;
+                if (i >= nconns)
+                    nconns = i + 1;
+            }
+
+        for (i = 0; i < nconns; i++)
+        {
+            if (cpfd[i].fd < 0 || !cpfd[i].revents)
+                continue;
+            n = recv(cpfd[i].fd, conns[i].buf + conns[i].len, sizeof(conns[i].buf) - conns[i].len, 0);
+            if (n <= 0)
+            {
+                close(cpfd[i].fd);
+                cpfd[i].fd = -1;
+                continue;
+            }
+            conns[i].last = now;
+            conns[i].len += n;
+            while ((used = collect_batch(conns[i].buf, conns[i].len)) != 0)
+            {
+                if (used == (size_t) -1)
+                {
+                    /* lost framing, the sender reconnects and starts over */
+                    close(cpfd[i].fd);
+                    cpfd[i].fd = -1;
+                    break;
+                }
+                conns[i].len -= used;
+                memmove(conns[i].buf, conns[i].buf + used, conns[i].len);
+            }
+        }
+    }
+}
+
+/*
+ * Upgrade handoff.  A new resident instance configured with the same
+ * "handoff" path connects to the running one, which answers with a
+ * snapshot of its peers and sync state in one SOCK_SEQPACKET message,
+ * the server, vsock listener and peer sockets riding along as
+ * SCM_RIGHTS.  Guests connected over vsock reconnect to the listener.  Requests
+ * keep queueing on the shared sockets meanwhile, so none are lost.  The
+ * old instance exits once the new one acknowledges; a snapshot from a
+ * different version or layout is refused and the old one carries on.
+ */
+struct ntp_handoff_peer {
+    struct sockaddr_in  addr;
+    int                 stream;
+    int                 valid;
+    int                 falseticker;
+    int64_t             next;
+    struct ntp_sample   sample;
+    struct ntp_query    query;
+};
+
+struct ntp_handoff {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            size;       /* sizeof(struct ntp_handoff) */
+    int32_t             port;       /* the server socket's port, 0 if none is passed */
+    int32_t             vport;      /* the vsock listener's port, 0 if none is passed */
+    int32_t             npeers;
+    struct ntp_sync     sync;
+    struct ntp_handoff_peer peers[CONF_MAX_SERVERS];
+};
+
+union ntp_handoff_cmsg {
+    char            buf[CMSG_SPACE(sizeof(int) * (2 + CONF_MAX_SERVERS))];
+    struct cmsghdr  align;
+};
+
+/* hand everything to the instance connecting on fd, 0 once it has taken over */
+int handoff_send(int fd, const struct ntp_peer *peers, int npeers, int servefd, int port,
+                 int vsockfd, int vport, const struct ntp_sync *sync, int timeout)
+{
+    static struct ntp_handoff h;
+    union ntp_handoff_cmsg cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    struct pollfd pfd;
+    int fds[2 + CONF_MAX_SERVERS], nfds = 0, conn, i;
+    char ack = 0;
+
+    if ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return -1;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HANDOFF_MAGIC, 8);
+    h.version = HANDOFF_VERSION;
+    h.size = sizeof(h);
+    h.sync = *sync;
+    if (servefd >= 0)
+    {
+        h.port = port;
+        fds[nfds++] = servefd;
+    }
+    if (vsockfd >= 0)
+    {
+        h.vport = vport;
+        fds[nfds++] = vsockfd;
+    }
+    /* a peer without a connection (or one still connecting), or a PTP one, is simply opened again by the new instance */
+    for (i = 0; i < npeers; i++)
+    {
+        if (peers[i].sockfd < 0 || peers[i].ptp || peers[i].connecting)
+            continue;
+        h.peers[h.npeers].addr = peers[i].addr;
+        h.peers[h.npeers].stream = peers[i].stream;
+        h.peers[h.npeers].valid = peers[i].valid;
+        h.peers[h.npeers].falseticker = peers[i].falseticker;
+        h.peers[h.npeers].next = peers[i].next;
+        h.peers[h.npeers].sample = peers[i].sample;
+        h.peers[h.npeers].query = peers[i].query;
+        h.npeers++;
+        fds[nfds++] = peers[i].sockfd;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds)
+    {
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+    }
+
+    pfd.fd = conn;
+    pfd.events = POLLIN;
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(h) || poll(&pfd, 1, timeout * 1000) != 1
+        || recv(conn, &ack, 1, 0) != 1 || ack != 1)
+    {
+        close(conn);
+        return -1;
+    }
+    close(conn);
+    return 0;
+}
+
+/* take over from the instance listening on path, 0 if there was one */
+int handoff_recv(const char *path, struct ntp_peer *peers, int *npeers, int *servefd, int *port,
+                 int *vsockfd, int *vport, struct ntp_sync *sync)
+{
+    static struct ntp_handoff h;
+    union ntp_handoff_cmsg cmsg;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    int fds[2 + CONF_MAX_SERVERS], nfds = 0, fd, i, n, lfds;
+    char ack;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if ((c = CMSG_FIRSTHDR(&msg)) != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    {
+        nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(c), sizeof(int) * nfds);
+    }
+
+    ack = n == sizeof(h) && memcmp(h.magic, HANDOFF_MAGIC, 8) == 0 && h.version == HANDOFF_VERSION
+          && h.size == sizeof(h) && h.npeers >= 0 && h.npeers <= CONF_MAX_SERVERS
+          && nfds == h.npeers + (h.port != 0) + (h.vport != 0);
+    if (!ack)
+    {
+        for (i = 0; i < nfds; i++)
+            close(fds[i]);
+        close(fd);
+        return -1;
+    }
+
+    *sync = h.sync;
+    *port = h.port;
+    *servefd = h.port ? fds[0] : -1;
+    *vport = h.vport;
+    *vsockfd = h.vport ? fds[h.port != 0] : -1;
+    lfds = (h.port != 0) + (h.vport != 0);
+    *npeers = h.npeers;
+    for (i = 0; i < h.npeers; i++)
+    {
+        memset(&peers[i], 0, sizeof(peers[i]));
+        peers[i].addr = h.peers[i].addr;
+        peers[i].sockfd = fds[lfds + i];
+        peers[i].stream = h.peers[i].stream;
+        peers[i].valid = h.peers[i].valid;
+        peers[i].falseticker = h.peers[i].falseticker;
+        peers[i].next = h.peers[i].next;
+        peers[i].sample = h.peers[i].sample;
+        peers[i].query = h.peers[i].query;
+    }
+
+    send(fd, &ack, 1, MSG_NOSIGNAL);
+    close(fd);
+    return 0;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage:\nntpc [-q] [-d] [-t] [-l port] [-C port] [-n count] [-i interval_ms] [-T] [-o file] {-c file | host} \n"
+                    "ntpc pool.ntp.org \nntpc -n 4 -i 500 ntp.aliyun.com\nntpc -d -c /etc/ntpc.conf\n"
+                    "ntpc -l 123 \n");
+}
+
+static struct ntp_conf confs[2];
+static struct ntp_conf *_Atomic current_conf = &confs[0];
+static _Atomic uint32_t confack;    /* gen of the snapshot the compute thread has moved to */
+
+/*
+ * Parse into the snapshot not in use and swap it in.  The previous one
+ * may still be read by the compute thread, which acknowledges a new
+ * snapshot before each drain; until it has, the reload returns 1 and is
+ * tried again, nudging the thread awake.
+ */
+int conf_reload(const char *path, const struct ntp_conf *base, const struct ntp_server_conf *defaults)
+{
+    struct ntp_conf *cur = atomic_load(&current_conf), *conf;
+
+    if (atomic_load(&confack) != cur->gen)
+    {
+        evpending = 1;
+        return 1;
+    }
+    conf = cur == &confs[0] ? &confs[1] : &confs[0];
+    if (conf_load(path, base, defaults, conf) != 0)
+        return -1;
+    conf->gen = cur->gen + 1;
+    atomic_store(&current_conf, conf);
+    return 0;
+}
+
+/* true when an inotify event on the config directory touched the config file */
+int conf_changed(int inofd, const char *path)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char name[NI_MAXHOST];
+    const struct inotify_event *ev;
+    ssize_t len;
+    int changed = 0;
+    char *p;
+
+    snprintf(name, sizeof(name), "%s", path);
+    p = basename(name);
+
+    while ((len = read(inofd, buf, sizeof(buf))) > 0)
+    {
+        for (ev = (void *) buf; (char *) ev < buf + len; ev = (void *) ((char *) ev + sizeof(*ev) + ev->len))
+            if (ev->len && strcmp(ev->name, p) == 0)
+                changed = 1;
+    }
+    return changed;
+}
+
+/* the compute side of a resident instance, fed by the I/O loop in main() */
+void *compute_thread(void *arg)
+{
+    struct pollfd pfd[2];
+    struct ntp_conf *conf;
+    int query = (int) (intptr_t) arg;
+    eventfd_t n;
+
+    pfd[0].fd = evfd;
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLOUT;
+
+    for (;;)
+    {
+        conf = atomic_load(&current_conf);
+        atomic_store(&confack, conf->gen);
+        if (compute_drain(conf, query) == -2)
+            break;
+        fflush(stdout);
+        pfd[1].fd = telemetry.outlen ? telemetry.fd : -1;
+        if (poll(pfd, 2, -1) > 0 && (pfd[0].revents & POLLIN))
+            eventfd_read(evfd, &n);
+    }
+
+    record_flush();
+    telemetry_drain(conf->timeout * 1000);
+    fflush(stdout);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, inofd = -1, npeers = 0, servefd = -1, port = 0, ctlfd, handofffd = -1;
+    int vsockfd = -1, vport = 0;
+    pid_t pid = 0, leaderpid = 0;
+    uint64_t counters[PERF_COUNTERS];
+    int query = 0, daemon = 0, timed = 0;
+    char *path = NULL, dir[NI_MAXHOST];
+    struct ntp_conf base, *conf;
+    struct ntp_server_conf defaults;
+    struct ntp_peer peers[CONF_MAX_SERVERS];
+    struct ntp_sync sync;
+    struct pollfd pfd[5 + 2 * CONF_MAX_SERVERS + VSOCK_CONNS];
+    static char outbuf[BUFSIZ];
+    struct timespec ts;
+    pthread_t tid, ctid;
+    eventfd_t n;
+    int64_t now, next, wake, reopen = 0, fastest;
+    int i, running, valid, reload = 0;
+
+    timing.main = now_ns(CLOCK_MONOTONIC);
+
+    /* stdio would otherwise allocate its buffer on the first printf */
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    memset(&base, 0, sizeof(base));
+    base.poll = NTP_POLL;
+    base.timeout = TIMEOUT;
+    base.meshprobe = MESH_PROBE;
+
+    memset(&defaults, 0, sizeof(defaults));
+    defaults.port = NTP_PORT;
+    defaults.version = NTP_VN;
+    defaults.burst = BURST_COUNT;
+    defaults.interval = BURST_INTERVAL;
+    defaults.poll = POLL_GLOBAL;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.stratum = NTP_LOCAL_STRATUM;
+    memcpy(&sync.refid, "LOCL", 4);
+
+    while ((opt = getopt(argc, argv, "qdtc:l:n:i:To:C:")) != -1)
+    {
+        switch (opt) {
+        case 'q':
+            query = 1;
+            break;
+        case 'd':
+            daemon = 1;
+            break;
+        case 't':
+            timed = 1;
+            timing.exec = exec_ns() - (now_ns(CLOCK_MONOTONIC) - timing.main);
+            break;
+        case 'c':
+            path = optarg;
+            break;
+        case 'l':
+            base.listen = atoi(optarg);
+            break;
+        case 'n':
+            defaults.burst = atoi(optarg);
+            break;
+        case 'i':
+            defaults.interval = atoi(optarg);
+            break;
+        case 'T':
+            defaults.txtime = 1;
+            break;
+        case 'o':
+            snprintf(base.record, sizeof(base.record), "%s", optarg);
+            break;
+        case 'C':
+            base.collect = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (argc - optind > (path ? 0 : 1) || (argc == optind && !path && !base.listen && !base.collect)
+        || defaults.burst < 1 || defaults.burst > BURST_MAX || defaults.interval < 0) {
+        usage();
+        exit(-1);
+    }
+
+    if (path)
+    {
+        if (conf_reload(path, &base, &defaults) != 0)
+        {
+            fprintf(stderr, "load %s error \n", path);
+            exit(-1);
+        }
+    }
+    else
+    {
+        conf = atomic_load(&current_conf);
+        *conf = base;
+        if (optind < argc && conf_parse_server(conf, &defaults, argv[optind], 0) != 0)
+            exit(-1);
+    }
+
+    conf = atomic_load(&current_conf);
+    if (conf->collect)
+    {
+        collect_run(conf);
+        perror("collect error");
+        exit(-1);
+    }
+
+    if (conf->state[0] && state_open(conf->state) != 0)
+    {
+        perror("state open error");
+        exit(-1);
+    }
+
+    if (conf->shm[0] && !query && shm_page_open(conf->shm) != 0)
+    {
+        perror("shm open error");
+        exit(-1);
+    }
+
+    if (conf->leader[0] && (daemon || conf->listen || conf->vsock) && leader_open(conf->leader) != 0)
+    {
+        perror("leader open error");
+        exit(-1);
+    }
+
+    if (conf->handoff[0] && (daemon || conf->listen || conf->vsock)
+        && handoff_recv(conf->handoff, peers, &npeers, &servefd, &port, &vsockfd, &vport, &sync) == 0)
+        printf("took over from the running instance \n");
+
+    timing.sockets = now_ns(CLOCK_MONOTONIC);
+    peers_sync(peers, &npeers, conf);
+    timing.sockets = now_ns(CLOCK_MONOTONIC) - timing.sockets;
+    peers_publish(peers, npeers);
+
+    if (conf->record[0] && record_open(conf->record) != 0)
+    {
+        perror("record open error");
+        exit(-1);
+    }
+
+    if (conf->collector[0] && telemetry_open(conf) != 0)
+    {
+        fprintf(stderr, "collector %s unknown \n", conf->collector);
+        exit(-1);
+    }
+
+    if (!daemon && !conf->listen && !conf->vsock)
+    {
+        timing.start = now_ns(CLOCK_MONOTONIC);
+        if (peers_start(peers, npeers, conf, timing.start) == 0 && statefile)
+        {
+            printf("no targets due \n");
+            return 0;
+        }
+        query_run(peers, npeers, conf->quorum ? conf->quorum : npeers, conf->timeout);
+        timing.quorum = now_ns(CLOCK_MONOTONIC);
+        event_push(EV_ROUND, NULL, NULL);
+        i = compute_drain(conf, query);
+        timing.applied = now_ns(CLOCK_MONOTONIC);
+        if (timed)
+            timing_report();
+        telemetry_drain(conf->timeout * 1000);
+        fflush(stdout);
+        if (i != 0)
+            exit(-1);
+        for (i = 0; i < npeers; i++)
+            peer_close(&peers[i]);
+        return 0;
+    }
+
+    resident = 1;
+    if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+        || (cmdfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+        || pthread_create(&ctid, NULL, compute_thread, (void *) (intptr_t) query) != 0)
+    {
+        perror("compute thread error");
+        exit(-1);
+    }
+
+    if (conf->control[0])
+    {
+        if ((ctlfd = unix_listen(conf->control, SOCK_STREAM)) < 0
+            || pthread_create(&tid, NULL, control_thread, (void *) (intptr_t) ctlfd) != 0)
+            perror("control socket error");
+    }
+
+    if (path)
+    {
+        snprintf(dir, sizeof(dir), "%s", path);
+        if ((inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+            || inotify_add_watch(inofd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+            perror("inotify error");
+    }
+    if (conf->handoff[0] && (handofffd = unix_listen(conf->handoff, SOCK_SEQPACKET)) < 0)
+        perror("handoff socket error");
+    if (conf->perf && perf_open() != 0)
+        perror("perf counters unavailable");
+
+    pfd[0].fd = inofd;
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLIN;
+    for (i = 0; i < VSOCK_CONNS; i++)
+        vconns[i].fd = -1;
+
+    for (;;)
+    {
+        /* a reload waits for the compute thread to let go of the older snapshot */
+        if (reload && (i = conf_reload(path, &base, &defaults)) != 1)
+        {
+            reload = 0;
+            if (i != 0)
+                fprintf(stderr, "reload %s failed, keeping the old configuration \n", path);
+            else
+            {
+                peers_sync(peers, &npeers, atomic_load(&current_conf));
+                peers_publish(peers, npeers);
+            }
+        }
+
+        /* a port is only recorded once its socket is open, a failed one is retried */
+        conf = atomic_load(&current_conf);
+        if ((conf->listen != port || conf->vsock != vport) && now_ns(CLOCK_MONOTONIC) >= reopen)
+        {
+            reopen = 0;
+            if (conf->listen != port)
+            {
+                if (servefd >= 0)
+                    close(servefd);
+                servefd = -1;
+                port = 0;
+                if (conf->listen && (servefd = serve_open(conf->listen)) < 0)
+                    perror("listen error");
+                else
+                    port = conf->listen;
+            }
+            if (conf->vsock != vport)
+            {
+                vsock_close(vsockfd);
+                vsockfd = -1;
+                vport = 0;
+                if (conf->vsock && (vsockfd = vsock_open(conf->vsock)) < 0)
+                    perror("vsock listen error");
+                else
+                    vport = conf->vsock;
+            }
+            if (conf->listen != port || conf->vsock != vport)
+                reopen = now_ns(CLOCK_MONOTONIC) + REOPEN_INTERVAL;
+        }
+        pfd[1].fd = servefd;
+
+        /* a follower serves the leader's state and sends nothing upstream */
+        if (leaderpage && !leading)
+        {
+            if (leader_try())
+                printf("leading \n");
+            else if ((pid = leader_read(&sync)) != 0 && pid != leaderpid)
+                printf("following pid %d \n", (int) pid);
+            leaderpid = pid;
+            fflush(stdout);
+        }
+
+        now = now_ns(CLOCK_MONOTONIC);
+        if (!leaderpage || leading)
+            peers_start(peers, npeers, conf, now);
+
+        /* a round waits only for the peers polled the fastest, a slower burst joins the next one */
+        for (i = 0, fastest = 0; i < npeers; i++)
+            if (peers[i].period && (fastest == 0 || peers[i].period < fastest))
+                fastest = peers[i].period;
+
+        wake = -1;
+        running = 0;
+        for (i = 0; i < npeers; i++)
+        {
+            if ((next = query_send(&peers[i], conf->timeout, now)) >= 0)
+                running += peers[i].period == 0 || peers[i].period <= fastest;
+            else
+                next = peers[i].next;
+            /* a pending connect is only waited on while a query needs it */
+            pfd[2 + i].fd = peers[i].connecting && !peers[i].query.active ? -1 : peers[i].sockfd;
+            pfd[2 + i].events = peers[i].connecting ? POLLOUT : POLLIN;
+            pfd[5 + npeers + VSOCK_CONNS + i].fd = peers[i].ptp ? peers[i].gsockfd : -1;
+            pfd[5 + npeers + VSOCK_CONNS + i].events = POLLIN;
+            if (wake < 0 || next < wake)
+                wake = next;
+        }
+        if (leaderpage && !leading)
+            wake = now + LEADER_CHECK;
+        if (reopen && (wake < 0 || reopen < wake))
+            wake = reopen;
+        if (reload && (wake < 0 || now + RELOAD_RETRY < wake))
+            wake = now + RELOAD_RETRY;
+
+        /* the round is over once every burst is in */
+        if (!running)
+        {
+            for (i = 0, valid = 0; i < npeers; i++)
+            {
+                valid |= peers[i].valid;
+                peers[i].valid = 0;
+            }
+            if (valid)
+                event_push(EV_ROUND, NULL, NULL);
+        }
+
+        pfd[2 + npeers].fd = cmdfd;
+        pfd[2 + npeers].events = POLLIN;
+        pfd[3 + npeers].fd = handofffd;
+        pfd[3 + npeers].events = POLLIN;
+        pfd[4 + npeers].fd = vsockfd;
+        pfd[4 + npeers].events = POLLIN;
+        for (i = 0; i < VSOCK_CONNS; i++)
+        {
+            pfd[5 + npeers + i].fd = vsockfd >= 0 ? vconns[i].fd : -1;
+            pfd[5 + npeers + i].events = POLLIN;
+        }
+
+        if (wake >= 0)
+        {
+            wake = wake > now ? wake - now : 0;
+            ts.tv_sec = wake / 1000000000;
+            ts.tv_nsec = wake % 1000000000;
+        }
+
+        event_notify();
+        if (ppoll(pfd, 5 + 2 * npeers + VSOCK_CONNS, wake >= 0 ? &ts : NULL, NULL) <= 0)
+            continue;
+
+        if (pfd[3 + npeers].revents & POLLIN)
+        {
+            if (handoff_send(handofffd, peers, npeers, servefd, port, vsockfd, vport, &sync, conf->timeout) == 0)
+            {
+                event_push(EV_STOP, NULL, NULL);
+                event_notify();
+                pthread_join(ctid, NULL);
+                leader_release();
+                printf("handed over to the new instance \n");
+                fflush(stdout);
+                exit(0);
+            }
+            fprintf(stderr, "handoff refused, carrying on \n");
+        }
+
+        if (pfd[1].revents & POLLIN)
+        {
+            perf_begin(counters);
+            perf_end(PERF_SERVE, counters, serve_packets(servefd, conf, &sync));
+        }
+
+        if ((pfd[2 + npeers].revents & POLLIN) && eventfd_read(cmdfd, &n) == 0)
+            for (; (i = spsc_peek(&cmdring, COMMAND_RING)) >= 0; spsc_release(&cmdring))
+                sync = commands[i];
+        if (leading && (pfd[2 + npeers].revents & POLLIN))
+            leader_publish(&sync);
+
+        for (i = 0; i < VSOCK_CONNS; i++)
+            if (pfd[5 + npeers + i].revents)
+                vsock_serve(&vconns[i], conf, &sync);
+        if (pfd[4 + npeers].revents & POLLIN)
+            vsock_accept(vsockfd);
+
+        for (i = 0; i < npeers; i++)
+            if ((pfd[2 + i].revents || pfd[5 + npeers + VSOCK_CONNS + i].revents) && !peers[i].connecting)
+            {
+                perf_begin(counters);
+                perf_end(PERF_QUERY, counters, query_recv(&peers[i]));
+            }
+
+        if ((pfd[0].revents & POLLIN) && conf_changed(inofd, path))
+            reload = 1;
+    }
 
     return 0;
 }
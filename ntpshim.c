@@ -0,0 +1,140 @@
+/*
+ * ntpshim.c - corrected wall clock for processes that cannot set it
+ *
+ * LD_PRELOAD=./libntpshim.so program
+ *
+ * clock_gettime(CLOCK_REALTIME), gettimeofday() and time() return the
+ * system clock plus the offset an ntpc instance with "shm" publishes.
+ * The page is read with a seqlock on top of the vDSO clock, so a call
+ * costs a few loads more than the original and never a system call.
+ * NTPC_SHM names the page, /dev/shm/ntpc by default; without a valid
+ * page, or once its offset has expired because ntpc stopped renewing
+ * it, the calls pass straight through.  A page that is not there yet is
+ * looked for again at most once every SHIM_RETRY, so a program started
+ * before ntpc picks it up.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+/* glibc declares tv nonnull, which would let the compiler drop the NULL check below */
+#define gettimeofday libc_gettimeofday
+#include <sys/time.h>
+#undef gettimeofday
+
+#include "ntp.h"
+
+#define SHIM_RETRY          1000000000  /* ns, CLOCK_MONOTONIC between looks for a missing page */
+
+static const struct ntp_shm *_Atomic shm;
+static _Atomic int64_t retry;
+static int (*real_clock_gettime)(clockid_t, struct timespec *);
+
+static void shim_open(void)
+{
+    const char *path;
+    struct ntp_shm *page;
+    int fd;
+
+    if ((path = getenv("NTPC_SHM")) == NULL)
+        path = NTP_SHM_PATH;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+        return;
+    if (page->magic == NTP_SHM_MAGIC)
+        atomic_store(&shm, page);
+    else
+        munmap(page, sizeof(*page));
+}
+
+__attribute__((constructor))
+static void shim_init(void)
+{
+    real_clock_gettime = dlsym(RTLD_NEXT, "clock_gettime");
+    shim_open();
+}
+
+/* one caller at a time looks for the page again, once SHIM_RETRY has passed */
+static void shim_retry(void)
+{
+    struct timespec ts;
+    int64_t now, next = atomic_load_explicit(&retry, memory_order_relaxed);
+
+    if (real_clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return;
+    now = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (now < next || !atomic_compare_exchange_strong(&retry, &next, now + SHIM_RETRY))
+        return;
+    shim_open();
+}
+
+/* the system clock, corrected */
+static int realtime(struct timespec *ts)
+{
+    const struct ntp_shm *page;
+    int64_t ns, offset;
+
+    if (real_clock_gettime == NULL)
+        shim_init();
+    if ((page = atomic_load_explicit(&shm, memory_order_acquire)) == NULL)
+    {
+        shim_retry();
+        page = atomic_load_explicit(&shm, memory_order_acquire);
+    }
+    if (real_clock_gettime(CLOCK_REALTIME, ts) != 0)
+        return -1;
+    ns = (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+    if (page == NULL || ntp_shm_read(page, ns, &offset) != 0)
+        return 0;
+
+    ns += offset;
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+    if (ts->tv_nsec < 0)
+    {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000;
+    }
+    return 0;
+}
+
+int clock_gettime(clockid_t clk, struct timespec *ts)
+{
+    if (clk == CLOCK_REALTIME)
+        return realtime(ts);
+    if (real_clock_gettime == NULL)
+        shim_init();
+    return real_clock_gettime(clk, ts);
+}
+
+int gettimeofday(struct timeval *restrict tv, void *restrict tz)
+{
+    struct timespec ts;
+
+    (void) tz;
+    if (tv == NULL)
+        return 0;
+    if (realtime(&ts) != 0)
+        return -1;
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    return 0;
+}
+
+time_t time(time_t *t)
+{
+    struct timespec ts;
+
+    if (realtime(&ts) != 0)
+        return (time_t) -1;
+    if (t)
+        *t = ts.tv_sec;
+    return ts.tv_sec;
+}
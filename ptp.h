@@ -0,0 +1,163 @@
+/* ptp.h - IEEE 1588 (PTPv2) messages for the unicast UDP client */
+#ifndef PTP_H
+#define PTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#define PTP_VERSION         2
+
+#define PTP_EVENT_PORT      319         /* Sync, Delay_Req */
+#define PTP_GENERAL_PORT    320         /* Follow_Up, Delay_Resp, Signaling */
+
+#define PTP_SYNC            0x0
+#define PTP_DELAY_REQ       0x1
+#define PTP_FOLLOW_UP       0x8
+#define PTP_DELAY_RESP      0x9
+#define PTP_ANNOUNCE        0xb
+#define PTP_SIGNALING       0xc
+
+#define PTP_FLAG_TWO_STEP   0x02        /* in flags[0] */
+#define PTP_FLAG_UNICAST    0x04
+
+#define PTP_TLV_REQUEST_UNICAST     0x0004
+#define PTP_TLV_GRANT_UNICAST       0x0005
+
+#define PTP_UTC_OFFSET      37          /* TAI - UTC in seconds, PTP timestamps are TAI */
+
+/* all fields in network byte order */
+struct ptp_port_id {
+    uint8_t     clock[8];
+    uint16_t    port;
+} __attribute__((packed));
+
+struct ptp_ts {
+    uint16_t    sec_hi;
+    uint32_t    sec_lo;
+    uint32_t    nsec;
+} __attribute__((packed));
+
+struct ptphdr {
+    uint8_t             ptp_type;       /* transportSpecific:4 messageType:4 */
+    uint8_t             ptp_version;    /* reserved:4 versionPTP:4 */
+    uint16_t            ptp_length;
+    uint8_t             ptp_domain;
+    uint8_t             ptp_reserved1;
+    uint8_t             ptp_flags[2];
+    int64_t             ptp_correction; /* ns * 2^16 */
+    uint32_t            ptp_reserved2;
+    struct ptp_port_id  ptp_source;
+    uint16_t            ptp_seq;
+    uint8_t             ptp_control;
+    int8_t              ptp_interval;   /* log2 seconds */
+} __attribute__((packed));
+
+/* Sync, Delay_Req and Follow_Up carry one timestamp */
+struct ptp_msg {
+    struct ptphdr       hdr;
+    struct ptp_ts       ts;
+} __attribute__((packed));
+
+struct ptp_delay_resp {
+    struct ptphdr       hdr;
+    struct ptp_ts       ts;             /* when the master received the Delay_Req */
+    struct ptp_port_id  requester;
+} __attribute__((packed));
+
+/* REQUEST_UNICAST_TRANSMISSION has the first 6 bytes of the value, a grant all 8 */
+struct ptp_tlv_unicast {
+    uint16_t            type;
+    uint16_t            length;
+    uint8_t             msgtype;        /* messageType:4 reserved:4 */
+    int8_t              interval;
+    uint32_t            duration;       /* seconds, 0 in a grant is a refusal */
+    uint8_t             reserved;
+    uint8_t             renew;
+} __attribute__((packed));
+
+/* followed by TLVs back to back */
+struct ptp_signaling {
+    struct ptphdr       hdr;
+    struct ptp_port_id  target;
+} __attribute__((packed));
+
+#define PTP_TLV_REQUEST_LEN 10
+#define PTP_TLV_GRANT_LEN   12
+
+static inline int ptp_type(const struct ptphdr *ptp)
+{
+    return ptp->ptp_type & 0x0f;
+}
+
+/* a header view of buf, or NULL unless it holds a PTPv2 message that long */
+static inline struct ptphdr *ptp_view(void *buf, size_t len)
+{
+    struct ptphdr *ptp = (struct ptphdr *) buf;
+
+    if (len < sizeof(*ptp) || (ptp->ptp_version & 0x0f) != PTP_VERSION || ntohs(ptp->ptp_length) > len)
+        return NULL;
+    return ptp;
+}
+
+static inline void ptp_init(struct ptphdr *ptp, int type, size_t length, int domain,
+                            const struct ptp_port_id *source, uint16_t seq, int interval)
+{
+    static const uint8_t control[16] = { 0, 1, 5, 5, 5, 5, 5, 5, 2, 3, 5, 5, 5, 5, 5, 5 };
+
+    memset(ptp, 0, length);
+    ptp->ptp_type = (uint8_t) type;
+    ptp->ptp_version = PTP_VERSION;
+    ptp->ptp_length = htons((uint16_t) length);
+    ptp->ptp_domain = (uint8_t) domain;
+    ptp->ptp_flags[0] = PTP_FLAG_UNICAST;
+    ptp->ptp_source = *source;
+    ptp->ptp_seq = htons(seq);
+    ptp->ptp_control = control[type & 0x0f];
+    ptp->ptp_interval = (int8_t) interval;
+}
+
+/* the correction field in ns */
+static inline int64_t ptp_correction(const struct ptphdr *ptp)
+{
+    return (int64_t) be64toh((uint64_t) ptp->ptp_correction) >> 16;
+}
+
+/* write a unicast request or grant TLV at p, returns its length */
+static inline size_t ptp_tlv_put(void *p, int type, int msgtype, int interval, uint32_t duration)
+{
+    struct ptp_tlv_unicast tlv;
+    size_t len = type == PTP_TLV_GRANT_UNICAST ? PTP_TLV_GRANT_LEN : PTP_TLV_REQUEST_LEN;
+
+    memset(&tlv, 0, sizeof(tlv));
+    tlv.type = htons((uint16_t) type);
+    tlv.length = htons((uint16_t) (len - 4));
+    tlv.msgtype = (uint8_t) (msgtype << 4);
+    tlv.interval = (int8_t) interval;
+    tlv.duration = htonl(duration);
+    memcpy(p, &tlv, len);
+    return len;
+}
+
+/* PTP (TAI) timestamps, converted from and to unix ns */
+static inline int64_t ptp_ts_to_nsec(struct ptp_ts ts)
+{
+    int64_t sec = (int64_t) ntohs(ts.sec_hi) << 32 | ntohl(ts.sec_lo);
+
+    return (sec - PTP_UTC_OFFSET) * 1000000000 + ntohl(ts.nsec);
+}
+
+static inline struct ptp_ts ptp_ts_from_nsec(int64_t nsec)
+{
+    struct ptp_ts ts;
+    int64_t sec = nsec / 1000000000 + PTP_UTC_OFFSET;
+
+    ts.sec_hi = htons((uint16_t) (sec >> 32));
+    ts.sec_lo = htonl((uint32_t) sec);
+    ts.nsec = htonl((uint32_t) (nsec % 1000000000));
+    return ts;
+}
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * ptpmaster.c - a stand-in unicast PTP master for trying "ptp:" servers
+ *
+ * ptpmaster [-p port] [-o offset]
+ *
+ * Grants every unicast request, sends two-step Syncs at the granted rate
+ * with their software transmit times in the Follow_Ups, and answers
+ * Delay_Reqs with the time the kernel received them.  It listens on port
+ * (319 by default) for event messages and port + 1 for general ones, and
+ * sends to a client's event port and that port + 1 likewise, the event
+ * port being the source of its Delay_Reqs and one below the source of
+ * its Signaling.  -o runs the served clock offset seconds ahead.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "ptp.h"
+
+#define CLIENTS             16
+#define BUFSIZE             1500
+
+struct client {
+    struct sockaddr_in  addr;       /* event port */
+    int64_t             until;      /* CLOCK_MONOTONIC ns the grant ends */
+    int64_t             next;
+    int64_t             period;
+    uint16_t            seq;
+};
+
+static struct client clients[CLIENTS];
+static struct ptp_port_id self;
+static int64_t offset;              /* ns */
+
+int64_t now_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* with txstamp the software transmit times are queued on the error queue */
+int open_port(int port, int txstamp)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1, flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+                            | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0
+        || (txstamp && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+        || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        return -1;
+    return fd;
+}
+
+/*
+ * Unix ns the kernel sent the last packet on fd, or fallback without a
+ * stamp.  The error queue is drained so a late stamp cannot keep poll()
+ * reporting POLLERR.
+ */
+int64_t tx_stamp(int fd, int64_t fallback)
+{
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct pollfd pfd = { fd, 0, 0 };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    struct scm_timestamping ts;
+    int64_t stamp = fallback;
+
+    if (poll(&pfd, 1, 1) != 1)
+        return fallback;
+
+    for (;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return stamp;
+        for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+            {
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                stamp = (int64_t) ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+            }
+    }
+}
+
+ssize_t recv_stamped(int fd, void *buf, size_t len, struct sockaddr_in *from, int64_t *stamp)
+{
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    struct timespec ts;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = sizeof(*from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((n = recvmsg(fd, &msg, 0)) < 0)
+        return -1;
+    *stamp = now_ns(CLOCK_REALTIME);
+    for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            *stamp = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    return n;
+}
+
+/* grant the requests in a Signaling message, starting Syncs for the sender */
+void signaling(int fd, char *buf, ssize_t n, struct sockaddr_in *from)
+{
+    char reply[BUFSIZE];
+    struct ptp_signaling *sig = (struct ptp_signaling *) buf;
+    struct ptp_tlv_unicast tlv;
+    struct client *c = NULL;
+    size_t off, len = sizeof(*sig);
+    int i, interval;
+
+    for (off = sizeof(*sig); off + PTP_TLV_REQUEST_LEN <= (size_t) n && len + PTP_TLV_GRANT_LEN <= sizeof(reply);
+         off += 4 + ntohs(tlv.length))
+    {
+        memcpy(&tlv, buf + off, PTP_TLV_REQUEST_LEN);
+        if (ntohs(tlv.type) != PTP_TLV_REQUEST_UNICAST)
+            continue;
+        interval = tlv.interval < -7 ? -7 : tlv.interval > 4 ? 4 : tlv.interval;
+        len += ptp_tlv_put(reply + len, PTP_TLV_GRANT_UNICAST, tlv.msgtype >> 4, interval, ntohl(tlv.duration));
+        if (tlv.msgtype >> 4 != PTP_SYNC)
+            continue;
+
+        /* a renewal keeps its slot, a new client takes an expired one */
+        for (i = 0; i < CLIENTS && c == NULL; i++)
+            if (clients[i].addr.sin_addr.s_addr == from->sin_addr.s_addr
+                && clients[i].addr.sin_port == htons(ntohs(from->sin_port) - 1))
+                c = &clients[i];
+        for (i = 0; i < CLIENTS && c == NULL; i++)
+            if (clients[i].until < now_ns(CLOCK_MONOTONIC))
+                c = &clients[i];
+        if (c == NULL)
+            continue;
+        c->addr = *from;
+        c->addr.sin_port = htons(ntohs(from->sin_port) - 1);
+        c->period = interval >= 0 ? (int64_t) 1000000000 << interval : 1000000000 >> -interval;
+        c->next = now_ns(CLOCK_MONOTONIC);
+        c->until = c->next + (int64_t) ntohl(tlv.duration) * 1000000000;
+    }
+
+    /* ptp_init clears the header only, the grants are already in place */
+    ptp_init((struct ptphdr *) reply, PTP_SIGNALING, sizeof(struct ptphdr), 0, &self,
+             ntohs(sig->hdr.ptp_seq), 0x7f);
+    ((struct ptphdr *) reply)->ptp_length = htons((uint16_t) len);
+    memcpy(&((struct ptp_signaling *) reply)->target, &sig->hdr.ptp_source, sizeof(struct ptp_port_id));
+    sendto(fd, reply, len, 0, (struct sockaddr *) from, sizeof(*from));
+}
+
+void delay_resp(int fd, char *buf, struct sockaddr_in *from, int64_t stamp)
+{
+    struct ptp_msg *req = (struct ptp_msg *) buf;
+    struct ptp_delay_resp resp;
+
+    ptp_init(&resp.hdr, PTP_DELAY_RESP, sizeof(resp), req->hdr.ptp_domain, &self, ntohs(req->hdr.ptp_seq), 0x7f);
+    resp.ts = ptp_ts_from_nsec(stamp + offset);
+    resp.requester = req->hdr.ptp_source;
+    from->sin_port = htons(ntohs(from->sin_port) + 1);
+    sendto(fd, &resp, sizeof(resp), 0, (struct sockaddr *) from, sizeof(*from));
+}
+
+void sync_send(int evfd, int genfd, struct client *c)
+{
+    struct ptp_msg msg;
+    struct sockaddr_in general = c->addr;
+    int64_t t;
+
+    ptp_init(&msg.hdr, PTP_SYNC, sizeof(msg), 0, &self, c->seq, 0);
+    msg.hdr.ptp_flags[0] |= PTP_FLAG_TWO_STEP;
+    t = now_ns(CLOCK_REALTIME);
+    msg.ts = ptp_ts_from_nsec(t + offset);
+    sendto(evfd, &msg, sizeof(msg), 0, (struct sockaddr *) &c->addr, sizeof(c->addr));
+
+    ptp_init(&msg.hdr, PTP_FOLLOW_UP, sizeof(msg), 0, &self, c->seq++, 0);
+    msg.ts = ptp_ts_from_nsec(tx_stamp(evfd, t) + offset);
+    general.sin_port = htons(ntohs(c->addr.sin_port) + 1);
+    sendto(genfd, &msg, sizeof(msg), 0, (struct sockaddr *) &general, sizeof(general));
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd pfd[2];
+    struct sockaddr_in from;
+    struct ptphdr *ptp;
+    char buf[BUFSIZE];
+    int64_t now, wake, stamp;
+    ssize_t n;
+    int opt, port = PTP_EVENT_PORT, i;
+
+    while ((opt = getopt(argc, argv, "p:o:")) != -1)
+    {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            offset = (int64_t) (atof(optarg) * 1e9);
+            break;
+        default:
+            fprintf(stderr, "usage: ptpmaster [-p port] [-o offset] \n");
+            exit(-1);
+        }
+    }
+
+    memcpy(self.clock, "PTPMSTR", 8);
+    self.port = htons(1);
+    if ((pfd[0].fd = open_port(port, 1)) < 0 || (pfd[1].fd = open_port(port + 1, 0)) < 0)
+    {
+        perror("socket error");
+        exit(-1);
+    }
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLIN;
+
+    for (;;)
+    {
+        now = now_ns(CLOCK_MONOTONIC);
+        wake = now + 1000000000;
+        for (i = 0; i < CLIENTS; i++)
+        {
+            if (clients[i].until < now)
+                continue;
+            if (clients[i].next <= now)
+            {
+                sync_send(pfd[0].fd, pfd[1].fd, &clients[i]);
+                clients[i].next += clients[i].period;
+            }
+            if (clients[i].next < wake)
+                wake = clients[i].next;
+        }
+
+        if (poll(pfd, 2, (int) ((wake - now) / 1000000)) <= 0)
+            continue;
+
+        if ((pfd[0].revents & POLLIN) && (n = recv_stamped(pfd[0].fd, buf, sizeof(buf), &from, &stamp)) > 0
+            && (ptp = ptp_view(buf, n)) != NULL && ptp_type(ptp) == PTP_DELAY_REQ
+            && n >= (ssize_t) sizeof(struct ptp_msg))
+            delay_resp(pfd[1].fd, buf, &from, stamp);
+
+        if ((pfd[1].revents & POLLIN) && (n = recv_stamped(pfd[1].fd, buf, sizeof(buf), &from, &stamp)) > 0
+            && (ptp = ptp_view(buf, n)) != NULL && ptp_type(ptp) == PTP_SIGNALING
+            && n >= (ssize_t) sizeof(struct ptp_signaling))
+            signaling(pfd[1].fd, buf, n, &from);
+    }
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""coldstart.py - time ntpc from exec to the applied offset, per configuration
+
+tools/coldstart.py [runs]
+
+Builds ntpc, starts SERVERS stand-in "ntpc -l" servers on localhost and a
+stand-in DNS server answering s<N>.ntpc.test with 127.0.0.1, then runs
+one-shot "ntpc -t" for each configuration: addresses given directly vs
+names through DNS, one vs SERVERS servers, quorum 1 vs all.  Each run
+writes a private shm page instead of setting the clock.  NTPC_T0 is taken
+just before the spawn, so exec is exact rather than /proc's clock tick.
+Prints the median of each phase over the runs (20 by default) in ms.
+
+The DNS cases need root: the script re-runs itself in a private mount
+namespace (unshare -m) with /etc/resolv.conf bind-mounted to point at
+the stand-in on 127.0.0.1:53.  Without root they are skipped.
+"""
+import os
+import socket
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SERVERS = 4
+PORT = 12330
+PHASES = ["exec", "dns", "socket", "first", "quorum", "apply", "total"]
+
+
+def dns_serve(sock):
+    """answer A queries for *.ntpc.test with 127.0.0.1, anything else with NXDOMAIN"""
+    while True:
+        query, addr = sock.recvfrom(512)
+        if len(query) < 12:
+            continue
+        end = 12
+        while end < len(query) and query[end]:
+            end += query[end] + 1
+        question = query[12:end + 5]
+        labels, i = [], 12
+        while i < end:
+            labels.append(query[i + 1:i + 1 + query[i]].decode(errors="replace"))
+            i += query[i] + 1
+        qtype = struct.unpack("!H", query[end + 1:end + 3])[0] if end + 3 <= len(query) else 0
+        found = ".".join(labels[-2:]).lower() == "ntpc.test"
+        answer = b""
+        if found and qtype == 1:
+            answer = b"\xc0\x0c" + struct.pack("!HHIH", 1, 1, 60, 4) + socket.inet_aton("127.0.0.1")
+        flags = 0x8180 if found else 0x8183
+        header = query[:2] + struct.pack("!HHHHH", flags, 1, 1 if answer else 0, 0, 0)
+        sock.sendto(header + question + answer, addr)
+
+
+def dns_start(tmp):
+    """the stand-in resolver, with resolv.conf pointing at it in this mount namespace"""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 53))
+    conf = os.path.join(tmp, "resolv.conf")
+    with open(conf, "w") as f:
+        f.write("nameserver 127.0.0.1\noptions attempts:1 timeout:1\n")
+    subprocess.run(["mount", "--bind", conf, "/etc/resolv.conf"], check=True)
+    threading.Thread(target=dns_serve, args=(sock,), daemon=True).start()
+
+
+def run(ntpc, conf, tmp):
+    """one cold start, the phases in ms"""
+    env = dict(os.environ, NTPC_T0=str(time.time_ns()))
+    out = subprocess.run([ntpc, "-t", "-c", conf], env=env, cwd=tmp,
+                         stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True).stdout
+    for line in out.splitlines():
+        if line.startswith("timing "):
+            words = line.split()
+            return {words[i]: float(words[i + 1]) for i in range(1, len(words) - 1, 2)}
+    raise RuntimeError(conf + ": no timing line\n" + out)
+
+
+def main():
+    runs = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    dns = os.geteuid() == 0
+
+    if dns and os.environ.get("NTPC_COLDSTART_NS") is None:
+        os.environ["NTPC_COLDSTART_NS"] = "1"
+        os.execvp("unshare", ["unshare", "-m", "--propagation", "private", sys.executable] + sys.argv)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        ntpc = os.path.join(tmp, "ntpc")
+        subprocess.run(["gcc", "-O2", os.path.join(root, "ntpc.c"), "-o", ntpc, "-lm", "-pthread"], check=True)
+        servers = [subprocess.Popen([ntpc, "-l", str(PORT + i)], stdout=subprocess.DEVNULL,
+                                    stderr=subprocess.DEVNULL) for i in range(SERVERS)]
+        try:
+            if dns:
+                dns_start(tmp)
+            time.sleep(0.5)
+
+            configs = []
+            for named in ([False, True] if dns else [False]):
+                for n in [1, SERVERS]:
+                    for quorum in ([0] if n == 1 else [1, 0]):
+                        name = "%s %d server%s%s" % ("dns" if named else "ip ", n, "s" if n > 1 else " ",
+                                                     " quorum 1" if quorum else "")
+                        conf = os.path.join(tmp, "c%d.conf" % len(configs))
+                        with open(conf, "w") as f:
+                            f.write("shm %s\n" % os.path.join(tmp, "shm%d" % len(configs)))
+                            if quorum:
+                                f.write("quorum %d\n" % quorum)
+                            for i in range(n):
+                                host = "s%d.ntpc.test" % i if named else "127.0.0.1"
+                                f.write("server %s port %d\n" % (host, PORT + i))
+                        configs.append((name, conf))
+            if not dns:
+                print("not root, DNS configurations skipped")
+
+            print("%-26s" % "median ms" + "".join("%9s" % p for p in PHASES))
+            for name, conf in configs:
+                samples = [run(ntpc, conf, tmp) for _ in range(runs)]
+                print("%-26s" % name + "".join("%9.3f" % statistics.median(s[p] for s in samples) for p in PHASES))
+        finally:
+            for s in servers:
+                s.kill()
+
+
+if __name__ == "__main__":
+    main()
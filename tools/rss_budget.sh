@@ -0,0 +1,71 @@
+#!/bin/sh
+# rss_budget.sh - build the constrained ntpc, load it and check its memory
+#
+# tools/rss_budget.sh [budget_kb]
+#
+# Builds ntpc with the small -D limits from the README, runs it as a
+# non-setting (-q) daemon that serves, samples clients and answers the
+# control socket against a stand-in "ntpc -l" server on localhost, sends
+# it REQUESTS client packets plus a control dump, then compares VmRSS and
+# VmHWM from /proc with the budget (RSS_BUDGET_KB, 3072 by default).  The
+# bss from size is held to the same budget, so tables that are linked in
+# but never touched cannot hide behind the RSS.  Exits 1 when any is over.  Needs gcc and python3.
+
+cd "$(dirname "$0")/.." || exit 2
+
+BUDGET=${1:-${RSS_BUDGET_KB:-3072}}
+REQUESTS=${REQUESTS:-5000}
+PORT=${PORT:-12310}
+CFLAGS_SMALL="-Os -DCONF_MAX_SERVERS=2 -DMRU_SIZE=64 -DBURST_MAX=4 -DSTATE_SIZE=64 -DCOLLECT_SIZE=64
+              -DCOLLECT_CONNS=4 -DTELEMETRY_RING=16 -DEVENT_RING=16 -DVSOCK_CONNS=2 -DSERVE_BATCH=4"
+
+DIR=$(mktemp -d) || exit 2
+trap 'kill $SERVER $CLIENT 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 ntpc.c -o "$DIR/ntpc" -lm -pthread || exit 2
+gcc $CFLAGS_SMALL ntpc.c -o "$DIR/ntpc-small" -lm -pthread || exit 2
+size "$DIR/ntpc-small"
+BSS=$(size "$DIR/ntpc-small" | awk 'NR == 2 { print int(($3 + 1023) / 1024) }')
+if [ "$BSS" -gt "$BUDGET" ]; then
+    echo "bss $BSS kB budget $BUDGET kB"
+    exit 1
+fi
+
+cat > "$DIR/ntpc.conf" <<CONF
+listen $((PORT + 1))
+mru 4
+control $DIR/ctl.sock
+server 127.0.0.1 port $PORT interval 100 burst 4
+CONF
+
+"$DIR/ntpc" -l $PORT > /dev/null 2>&1 &
+SERVER=$!
+"$DIR/ntpc-small" -q -d -c "$DIR/ntpc.conf" > /dev/null 2>&1 &
+CLIENT=$!
+sleep 3
+
+python3 - "$((PORT + 1))" "$REQUESTS" "$DIR/ctl.sock" <<'PY'
+import socket, sys
+port, n, ctl = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(0.2)
+for i in range(n):
+    s.sendto(bytes([0x23]) + bytes(47), ("127.0.0.1", port))
+    try:
+        s.recv(128)
+    except socket.timeout:
+        pass
+c = socket.socket(socket.AF_UNIX)
+c.connect(ctl)
+while c.recv(65536):
+    pass
+PY
+
+if ! kill -0 $CLIENT 2>/dev/null; then
+    echo "ntpc exited"
+    exit 1
+fi
+RSS=$(awk '/^VmRSS/ { print $2 }' /proc/$CLIENT/status)
+HWM=$(awk '/^VmHWM/ { print $2 }' /proc/$CLIENT/status)
+echo "VmRSS $RSS kB VmHWM $HWM kB bss $BSS kB budget $BUDGET kB"
+[ "$RSS" -le "$BUDGET" ] && [ "$HWM" -le "$BUDGET" ]